@@ -58,7 +58,10 @@ restore_registers:
   mov esi, [edx+16]
   mov ebx, [edx+20]
 
+  test eax, eax         ; 0 means the directory isn't changing, so
+  jz .same_directory    ; keep the TLB.
   mov cr3, eax
+.same_directory:
   mov eax, 1
   jmp ecx
 
@@ -246,6 +246,15 @@ namespace ata {
     }
   }
 
+  void Disk::write_pio(u8* c_buf, int count) {
+    u16* buf = (u16*)c_buf;
+    u32 words = count / 2;
+
+    for(u32 i = 0; i < words; i++) {
+      io_.outw(buf[i], ATA_REG_DATA);
+    }
+  }
+
   bool Disk::lba48_p() {
     if(info_.capability & ATA_CAPA_LBA) {
       return (info_.command_sets & ATA_CS_LBA48) != 0;
@@ -369,6 +378,82 @@ namespace ata {
     enable_irq();
   }
 
+  // Polled PIO with the drive's interrupt masked. Used where the
+  // caller can't sleep waiting for an interrupt, like swap.
+  bool Disk::transfer(u32 sector, u32 count, u8* data, bool write) {
+    ASSERT(count > 0 && count < 256);
+
+    // LBA28 only: the top four bits of the address share a register
+    // with the drive select.
+    const static u32 cMaxLBA28 = 0x0FFFFFFF;
+    if(sector > cMaxLBA28 || count > cMaxLBA28 + 1 - sector) return false;
+
+    // An interrupt driven read owns the registers until it's done.
+    // Waiting for it would mean letting interrupts in under a caller
+    // that may hold a spin lock, so turn the transfer down instead.
+    int st = cpu::disable_interrupts();
+
+    if(!interrupt_.idle_p()) {
+      cpu::restore_interrupts(st);
+      return false;
+    }
+
+    select();
+    while(busy_p());
+
+    control_.outb(0x08 | ATA_CTRL_DISABLE_IRQ);
+    io_.outb(count, ATA_REG_SECCOUNT0);
+    io_.outb((sector >> 0 ) & 0xff, ATA_REG_LBA0);
+    io_.outb((sector >> 8)  & 0xff, ATA_REG_LBA1);
+    io_.outb((sector >> 16) & 0xff, ATA_REG_LBA2);
+    io_.outb(((sector >> 24) & 0x0f) | 0x40 | (select_ & 0x10),
+             ATA_REG_HDDEVSEL);
+
+    io_.outb(write ? ATA_CMD_WRITE_PIO : ATA_CMD_READ_PIO, ATA_REG_COMMAND);
+
+    bool ok = true;
+
+    for(u32 i = 0; i < count; i++) {
+      while(busy_p());
+
+      if(error_p() || !drq_p()) {
+        ok = false;
+        break;
+      }
+
+      if(write) {
+        write_pio(data + i * 512, 512);
+      } else {
+        read_pio(data + i * 512, 512);
+      }
+    }
+
+    while(busy_p());
+
+    // The data has to be on the platter, not in the drive's cache.
+    if(ok && write) {
+      io_.outb(ATA_CMD_CACHE_FLUSH, ATA_REG_COMMAND);
+      while(busy_p());
+    }
+
+    if(error_p()) ok = false;
+
+    clear_irq();
+    enable_irq();
+
+    cpu::restore_interrupts(st);
+
+    return ok;
+  }
+
+  bool Disk::read_sectors(u32 sector, u32 count, u8* data) {
+    return transfer(sector, count, data, false);
+  }
+
+  bool Disk::write_sectors(u32 sector, u32 count, u8* data) {
+    return transfer(sector, count, data, true);
+  }
+
   void ATAInterrupt::handle(Registers* regs) {
     disk_->clear_irq();
 
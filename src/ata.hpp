@@ -132,6 +132,11 @@ namespace ata {
 
     void add_request(block::Buffer* buffer);
     void handle(Registers* regs);
+
+    // No interrupt driven read in progress.
+    bool idle_p() {
+      return request_buffer_ == 0;
+    }
   };
 
   class Disk : public block::Device {
@@ -163,12 +168,17 @@ namespace ata {
     void show_info();
     bool identify();
     void read_pio(u8* buf, int count);
+    void write_pio(u8* buf, int count);
+    bool transfer(u32 sector, u32 count, u8* data, bool write);
     void request_lba(u32 block, u8 count);
     void show_status();
   
     void fulfill(block::Buffer* buffer);
     void read_block(u32 block, u8* buffer);
 
+    bool read_sectors(u32 sector, u32 count, u8* data);
+    bool write_sectors(u32 sector, u32 count, u8* data);
+
     void wait_til_ready();
     void disable_irq();
     void enable_irq();
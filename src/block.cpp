@@ -2,15 +2,39 @@
 #include "kheap.hpp"
 #include "console.hpp"
 #include "fs/devfs.hpp"
+#include "cpu.hpp"
+#include "scope.hpp"
+#include "reclaim.hpp"
+#include "swap.hpp"
 
 #include "block_buffer.hpp"
 
 namespace block {
   Registry registry;
 
+  static u32 shrink(u32 target) {
+    u32 bytes = target * cpu::cPageSize;
+    u32 freed = 0;
+
+    for(int i = 1; i < Registry::max_devices && freed < bytes; i++) {
+      if(Device* dev = registry.get(i)) {
+        freed += dev->shrink_cache(bytes - freed);
+      }
+    }
+
+    return freed / cpu::cPageSize;
+  }
+
+  static reclaim::Shrinker shrinker = {
+    "block-cache", shrink, reclaim::eBuffers, true, 0, 0
+  };
+
   void Registry::init() {
     used_ = 0;
 
+    Buffer::cache.init("block-buffer", sizeof(Buffer));
+    reclaim::add(&shrinker);
+
     for(int i = 0; i < max_devices; i++) {
       devices_[i] = 0;
     }
@@ -37,19 +61,70 @@ namespace block {
 
   block::Buffer* Device::request(block::RegionRange range) {
     block::Buffer* buffer;
-    if(cache_.fetch(range, &buffer)) {
-      return buffer;
-    }
 
-    u32 num_bytes = range.num_bytes();
-    buffer = block::Buffer::for_size(this, num_bytes);
-    buffer->set_range(range);
+    synchronized(cache_lock_) {
+      if(cache_.fetch(range, &buffer)) {
+        buffer->touch();
+        buffer->pin();
+        return buffer;
+      }
 
-    cache_.store(range, buffer);
+      u32 num_bytes = range.num_bytes();
+      buffer = block::Buffer::for_size(this, num_bytes);
+      buffer->set_range(range);
+      buffer->touch();
+      buffer->pin();
+
+      cache_.store(range, buffer);
+    }
 
     return buffer;
   }
 
+  u32 Device::shrink_cache(u32 max_bytes) {
+    const static u32 cMaxVictims = 32;
+
+    Buffer* victims[cMaxVictims];
+    u32 found = 0;
+    u32 bytes = 0;
+
+    // The cache is in use, possibly further up our own stack. Leave it.
+    if(!cache_lock_.try_lock()) return 0;
+
+    RegionCache::Iterator i = cache_.iterator();
+
+    while(found < cMaxVictims && bytes < max_bytes) {
+      auto entry = i.next();
+      if(!entry) break;
+
+      Buffer* buffer = entry->value;
+
+      // Reads still in flight, or with someone waiting on them, stay.
+      // So does anything somebody is still holding on to.
+      if(!buffer->full_p() || buffer->waiting_p()) continue;
+      if(buffer->pinned_p()) continue;
+
+      // Used since we last looked, give it another round.
+      if(buffer->age()) continue;
+
+      victims[found++] = buffer;
+      bytes += buffer->byte_size();
+    }
+
+    for(u32 j = 0; j < found; j++) {
+      cache_.remove(victims[j]->range());
+    }
+
+    cache_lock_.unlock();
+
+    for(u32 j = 0; j < found; j++) {
+      kfree(victims[j]->data());
+      kfree(victims[j]);
+    }
+
+    return bytes;
+  }
+
   u32 Device::read_bytes(u32 offset, u32 size, u8* out_buffer) {
     u32 cur_region = offset / cRegionSize;
 
@@ -65,11 +140,13 @@ namespace block {
     if(left > BlockSize) {
       u32 copy_bytes = cRegionSize - initial_offset;
       memcpy(out_buffer, buffer->data() + initial_offset, copy_bytes);
+      buffer->unpin();
       out_buffer += copy_bytes;
       left -= copy_bytes;
     } else {
       // Satisfied all out of the first block! Woo!
       memcpy(out_buffer, buffer->data() + initial_offset, left);
+      buffer->unpin();
       return size;
     }
 
@@ -87,6 +164,8 @@ namespace block {
         memcpy(out_buffer, buffer->data(), left);
         left = 0;
       }
+
+      buffer->unpin();
     }
 
     return size;
@@ -130,15 +209,27 @@ namespace block {
               name.c_str(), this, entry->lba, entry->sectors);
 
           block::registry.add(dev);
+
+          if(entry->type == swap::cPartitionType) swap::add_device(dev);
         }
         entry++;
       }
     }
 
-    kfree(buf);
+    buffer->unpin();
   }
 
   void SubDevice::fulfill(Buffer* buf) {
     parent_->fulfill(buf);
   }
+
+  bool SubDevice::read_sectors(u32 sector, u32 count, u8* data) {
+    if(sector + count > size_) return false;
+    return parent_->read_sectors(offset_ + sector, count, data);
+  }
+
+  bool SubDevice::write_sectors(u32 sector, u32 count, u8* data) {
+    if(sector + count > size_) return false;
+    return parent_->write_sectors(offset_ + sector, count, data);
+  }
 }
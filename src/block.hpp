@@ -5,6 +5,7 @@
 #include "string.hpp"
 #include "hash_table.hpp"
 #include "block_region.hpp"
+#include "spinlock.hpp"
 
 namespace block {
   // Must never be less than 512!
@@ -66,6 +67,7 @@ namespace block {
     int id_;
 
     RegionCache cache_;
+    SpinLock cache_lock_;
     u32 signature_;
 
   public:
@@ -82,11 +84,27 @@ namespace block {
       return name_.c_str();
     }
 
+    // The buffer comes back pinned, unpin it once done with the data.
     Buffer* request(RegionRange range);
     virtual void fulfill(Buffer* buffer) = 0;
 
     u32 read_bytes(u32 byte_offset, u32 byte_size, u8* buffer);
 
+    // Move whole 512 byte sectors without going through the buffer
+    // cache, waiting for them in place. Returns false on an error, or
+    // if the device can't do it.
+    virtual bool read_sectors(u32 sector, u32 count, u8* data) {
+      return false;
+    }
+
+    virtual bool write_sectors(u32 sector, u32 count, u8* data) {
+      return false;
+    }
+
+    // Free unpinned cached buffers that haven't been used since the
+    // last call, up to max_bytes of data. Returns the bytes freed.
+    u32 shrink_cache(u32 max_bytes);
+
     void detect_partitions();
 
     friend class Registry;
@@ -107,6 +125,13 @@ namespace block {
     {}
 
     void fulfill(Buffer* buffer);
+
+    u32 sectors() {
+      return size_;
+    }
+
+    bool read_sectors(u32 sector, u32 count, u8* data);
+    bool write_sectors(u32 sector, u32 count, u8* data);
   };
 
 }
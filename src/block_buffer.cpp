@@ -8,9 +8,11 @@
 #include "scheduler.hpp"
 
 namespace block {
+  slab::Cache Buffer::cache;
+
   Buffer* Buffer::for_size(Device* dev, u32 num_bytes) {
     u8* data = (u8*)kmalloc(num_bytes);
-    Buffer* buf = new(kheap) Buffer(num_bytes, data, dev);
+    Buffer* buf = new(cache) Buffer(num_bytes, data, dev);
     return buf;
   }
 
@@ -55,6 +57,7 @@ namespace block {
       state_ |= eFull;
       if(waiting_task_) {
         scheduler.make_ready(waiting_task_);
+        waiting_task_ = 0;
       }
     }
   }
@@ -3,6 +3,8 @@
 
 #include "block_region.hpp"
 #include "spinlock.hpp"
+#include "scope.hpp"
+#include "slab.hpp"
 
 class Thread;
 
@@ -14,7 +16,8 @@ namespace block {
       eUnknown = 0,
       eFree = 0x1,
       eFull = 0x2,
-      eRequested = 0x4
+      eRequested = 0x4,
+      eReferenced = 0x8
     };
 
   private:
@@ -22,6 +25,10 @@ namespace block {
     u16 state_;
     u8* data_;
 
+    // Holders that may still look at data_: callers of request and
+    // indexes pointing at the buffer. Reclaim leaves pinned ones be.
+    u32 pins_;
+
     Device* device_;
 
     RegionRange range_;
@@ -34,6 +41,7 @@ namespace block {
       : size_(size)
       , state_(eFree)
       , data_(data)
+      , pins_(0)
       , device_(dev)
       , range_(0,0)
       , waiting_task_(0)
@@ -75,6 +83,40 @@ namespace block {
 
     void set_full();
 
+    // Someone is blocked until the data arrives.
+    bool waiting_p() {
+      return waiting_task_ != 0;
+    }
+
+    // The cache's reclaim gives buffers a second chance: touch marks
+    // one as used, age clears the mark and reports whether it was set.
+    void touch() {
+      state_ |= eReferenced;
+    }
+
+    bool age() {
+      bool referenced = (state_ & eReferenced) == eReferenced;
+      state_ &= ~eReferenced;
+      return referenced;
+    }
+
+    void pin() {
+      synchronized(lock_) {
+        pins_++;
+      }
+    }
+
+    void unpin() {
+      synchronized(lock_) {
+        ASSERT(pins_ > 0);
+        pins_--;
+      }
+    }
+
+    bool pinned_p() {
+      return pins_ > 0;
+    }
+
     RegionRange& range() {
       return range_;
     }
@@ -92,6 +134,8 @@ namespace block {
     void wait();
 
     static Buffer* for_size(Device* dev, u32 size);
+
+    static slab::Cache cache;
   };
 }
 
@@ -0,0 +1,168 @@
+#include "buddy.hpp"
+#include "scope.hpp"
+
+BuddyAllocator frames;
+
+void BuddyAllocator::init(void* meta, u32 nframes) {
+  meta_ = (Frame*)meta;
+  nframes_ = nframes;
+  free_frames_ = 0;
+
+  memset((u8*)meta_, 0, meta_size(nframes));
+
+  for(u32 i = 0; i <= cMaxOrder; i++) {
+    free_lists_[i] = cNone;
+    stats_[i].free_blocks = 0;
+    stats_[i].allocs = 0;
+    stats_[i].frees = 0;
+  }
+}
+
+void BuddyAllocator::push(u32 frame, u32 order) {
+  Frame& f = meta_[frame];
+
+  f.flags |= eFree;
+  f.order = order;
+  f.prev = cNone;
+  f.next = free_lists_[order];
+
+  if(f.next != cNone) meta_[f.next].prev = frame;
+  free_lists_[order] = frame;
+
+  stats_[order].free_blocks++;
+}
+
+void BuddyAllocator::remove(u32 frame, u32 order) {
+  Frame& f = meta_[frame];
+
+  if(f.next != cNone) meta_[f.next].prev = f.prev;
+
+  if(f.prev != cNone) {
+    meta_[f.prev].next = f.next;
+  } else {
+    free_lists_[order] = f.next;
+  }
+
+  f.flags &= ~eFree;
+  f.next = f.prev = cNone;
+
+  stats_[order].free_blocks--;
+}
+
+// Put a block back, merging it with its buddy for as long as the buddy
+// is also a whole free block of the same order.
+void BuddyAllocator::release(u32 frame, u32 order) {
+  free_frames_ += (1 << order);
+
+  while(order < cMaxOrder) {
+    u32 buddy = frame ^ (1 << order);
+    if(buddy >= nframes_) break;
+
+    Frame& b = meta_[buddy];
+    if((b.flags & eFree) == 0 || b.order != order) break;
+
+    remove(buddy, order);
+    frame &= ~(1 << order);
+    order++;
+  }
+
+  push(frame, order);
+}
+
+void BuddyAllocator::add_range(u32 start, u32 end) {
+  if(end > nframes_) end = nframes_;
+
+  synchronized(lock_) {
+    u32 frame = start;
+
+    while(frame < end) {
+      // Use the biggest naturally aligned block that still fits.
+      u32 order = cMaxOrder;
+      while(order > 0 &&
+            ((frame & ((1 << order) - 1)) != 0 || frame + (1 << order) > end)) {
+        order--;
+      }
+
+      release(frame, order);
+      frame += (1 << order);
+    }
+  }
+}
+
+bool BuddyAllocator::alloc(u32 order, u32* out) {
+  ASSERT(order <= cMaxOrder);
+
+  synchronized(lock_) {
+    u32 o = order;
+    while(o <= cMaxOrder && free_lists_[o] == cNone) o++;
+
+    if(o > cMaxOrder) return false;
+
+    u32 frame = free_lists_[o];
+    remove(frame, o);
+
+    // Split off the upper halves until the block is the right size.
+    while(o > order) {
+      o--;
+      push(frame + (1 << o), o);
+    }
+
+    free_frames_ -= (1 << order);
+    stats_[order].allocs++;
+
+    // Each frame of the block can be shared and released on its own.
+    for(u32 i = 0; i < (1U << order); i++) {
+      meta_[frame + i].count = 1;
+      set_age(frame + i, 0);
+    }
+
+    *out = frame;
+    return true;
+  }
+
+  return false;
+}
+
+void BuddyAllocator::free(u32 frame, u32 order) {
+  ASSERT(frame < nframes_);
+  ASSERT((meta_[frame].flags & eFree) == 0);
+
+  synchronized(lock_) {
+    for(u32 i = 0; i < (1U << order); i++) {
+      meta_[frame + i].count = 0;
+    }
+
+    stats_[order].frees++;
+    release(frame, order);
+  }
+}
+
+void BuddyAllocator::get(u32 frame) {
+  synchronized(lock_) {
+    Frame& f = meta_[frame];
+    if(f.count == 0) f.count = 1;
+    f.count++;
+  }
+}
+
+bool BuddyAllocator::put(u32 frame) {
+  synchronized(lock_) {
+    Frame& f = meta_[frame];
+
+    if(f.count > 1) {
+      f.count--;
+      return false;
+    }
+
+    f.count = 0;
+    stats_[0].frees++;
+    release(frame, 0);
+  }
+
+  return true;
+}
+
+u32 BuddyAllocator::count(u32 frame) {
+  u32 c = meta_[frame].count;
+  return c ? c : 1;
+}
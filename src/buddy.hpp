@@ -0,0 +1,101 @@
+#ifndef BUDDY_HPP
+#define BUDDY_HPP
+
+#include "common.hpp"
+#include "spinlock.hpp"
+
+// Physical frames are handed out by a binary buddy allocator. A block
+// of order n is 2^n frames, physically contiguous and aligned to its
+// own size.
+class BuddyAllocator {
+public:
+  const static u32 cMaxOrder = 10;
+  const static u32 cNone = 0xFFFFFFFF;
+
+  struct Frame {
+    u32 next;   // Free list links, only valid for the head of a free block.
+    u32 prev;
+    u8 order;   // Order of the free block this frame heads.
+    u8 flags;
+    u16 count;  // References to an allocated frame, 1 when fresh.
+  };
+
+  enum Flags {
+    eFree = 1
+  };
+
+  // The upper bits of flags count how many working set scans in a row
+  // found an allocated frame unused.
+  const static u32 cAgeShift = 4;
+  const static u32 cMaxAge = 15;
+
+  struct OrderStats {
+    u32 free_blocks;
+    u32 allocs;
+    u32 frees;
+  };
+
+private:
+  Frame* meta_;
+  u32 nframes_;
+  u32 free_frames_;
+
+  u32 free_lists_[cMaxOrder + 1];
+  OrderStats stats_[cMaxOrder + 1];
+
+  SpinLock lock_;
+
+  void push(u32 frame, u32 order);
+  void remove(u32 frame, u32 order);
+  void release(u32 frame, u32 order);
+
+public:
+  // Number of bytes of metadata needed to track nframes frames.
+  static u32 meta_size(u32 nframes) {
+    return nframes * sizeof(Frame);
+  }
+
+  // All frames start out in use; add_range makes them available.
+  void init(void* meta, u32 nframes);
+  void add_range(u32 start, u32 end);
+
+  bool alloc(u32 order, u32* frame);
+  void free(u32 frame, u32 order);
+
+  // Reference counting for frames shared between page tables. put
+  // frees the frame once the last reference is dropped.
+  void get(u32 frame);
+  bool put(u32 frame);
+  u32 count(u32 frame);
+
+  u32 age(u32 frame) {
+    return meta_[frame].flags >> cAgeShift;
+  }
+
+  void set_age(u32 frame, u32 age) {
+    Frame& f = meta_[frame];
+    f.flags = (f.flags & ((1 << cAgeShift) - 1)) | (age << cAgeShift);
+  }
+
+  u32 nframes() {
+    return nframes_;
+  }
+
+  u32 free_frames() {
+    return free_frames_;
+  }
+
+  OrderStats& stats(u32 order) {
+    return stats_[order];
+  }
+
+  static u32 order_for(u32 pages) {
+    u32 order = 0;
+    while((1U << order) < pages) order++;
+    return order;
+  }
+};
+
+extern BuddyAllocator frames;
+
+#endif
@@ -5,6 +5,7 @@
 #include "monitor.hpp"
 #include "cpu.hpp"
 #include "inspector.hpp"
+#include "kheap_profile.hpp"
 
 extern "C" {
 
@@ -138,6 +139,7 @@ extern void panic(const char *message, const char *file, u32 line)
     console.printf("PANIC(%s) at %s:%d\n", message, file, line);
 
     inspector.print_backtrace();
+    kheap_profile::dump();
 
     // Halt by going into an infinite loop.
     cpu::halt_loop();
@@ -151,6 +153,7 @@ extern void panic_assert(const char *file, u32 line, const char *desc)
     console.printf("ASSERTION-FAILED(%s) at %s:%d\n", desc, file, line);
 
     inspector.print_backtrace();
+    kheap_profile::dump();
 
     // Halt by going into an infinite loop.
     cpu::halt_loop();
@@ -73,6 +73,7 @@ namespace cpu {
     u32 cr0;
     asm volatile("mov %%cr0, %0": "=r"(cr0));
     cr0 |= 0x80000000; // Enable paging!
+    cr0 |= 0x00010000; // Fault on kernel writes to read-only pages too.
     asm volatile("mov %0, %%cr0":: "r"(cr0));
   }
 
@@ -82,11 +83,52 @@ namespace cpu {
     return addr;
   }
 
+  static inline void invalidate_page(u32 addr) {
+    asm volatile("invlpg (%0)" :: "r"(addr) : "memory");
+  }
+
   static inline void flush_tbl() {
     // Flush the TLB by reading and writing the page directory address again.
+    // This leaves global (kernel) entries alone.
     set_page_directory(page_directory());
   }
 
+  static inline u32 read_cr4() {
+    u32 cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+  }
+
+  static inline void write_cr4(u32 cr4) {
+    asm volatile("mov %0, %%cr4" :: "r"(cr4) : "memory");
+  }
+
+  const static u32 cCR4GlobalPages = 0x80;
+
+  static inline bool global_pages_p() {
+    u32 eax = 1, ebx, ecx, edx;
+    asm volatile("cpuid" : "+a"(eax), "=b"(ebx), "=c"(ecx), "=d"(edx));
+    return (edx & (1 << 13)) != 0;
+  }
+
+  // Global pages survive CR3 reloads, so kernel mappings shared by
+  // every directory stay in the TLB across context switches.
+  static inline void enable_global_pages() {
+    if(global_pages_p()) write_cr4(read_cr4() | cCR4GlobalPages);
+  }
+
+  // Flush everything, global entries included, by toggling CR4.PGE.
+  static inline void flush_tlb_all() {
+    u32 cr4 = read_cr4();
+
+    if(cr4 & cCR4GlobalPages) {
+      write_cr4(cr4 & ~cCR4GlobalPages);
+      write_cr4(cr4);
+    } else {
+      flush_tbl();
+    }
+  }
+
   void print_cpuid();
 }
 
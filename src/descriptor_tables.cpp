@@ -10,6 +10,8 @@
 #include "isr.hpp"
 #include "paging.hpp"
 #include "cpu.hpp"
+#include "kstack.hpp"
+#include "console.hpp"
 
 extern "C" {
 
@@ -25,8 +27,9 @@ static void init_idt();
 static void gdt_set_gate(s32int,u32int,u32int,u8int,u8int);
 static void idt_set_gate(u8int,u32int,u16int,u8int);
 static void write_tss(s32int,u16int,u32int);
+static void write_double_fault_tss(s32int);
 
-#define GDT_ENTRIES 8
+#define GDT_ENTRIES 9
 
 gdt_entry_t gdt_entries[GDT_ENTRIES];
 gdt_ptr_t   gdt_ptr;
@@ -34,6 +37,11 @@ idt_entry_t idt_entries[256];
 idt_ptr_t   idt_ptr;
 tss_entry_t tss_entry;
 
+// A double fault is handled by a task of its own, so it gets a good
+// stack even when the fault came from running off the end of one.
+static tss_entry_t double_fault_tss;
+static u8 double_fault_stack[8192] __attribute__((aligned(16)));
+
 // Initialisation routine - zeroes all the interrupt service routines,
 // initialises the GDT and IDT.
 void init_descriptor_tables() {
@@ -62,6 +70,7 @@ static void init_gdt() {
 
   write_tss(6, 0x10, 0x0);
   gdt_set_gate(7, 0, 0,          0x92, 0xCF); // Percpu segment
+  write_double_fault_tss(8);
   gdt_flush((u32int)&gdt_ptr);
   tss_flush();
 }
@@ -120,6 +129,48 @@ void set_kernel_stack(u32int stack) {
   tss_entry.esp0 = stack;
 }
 
+// Entered by the task switch, with the interrupted state saved in
+// tss_entry and the error code on our stack. There's no going back.
+static void double_fault_task() {
+  u32 addr = cpu::fault_address();
+
+  // The CPU couldn't push the page fault frame onto the guard page,
+  // which is how a kernel stack overflow ends up here.
+  if(kstack::guard_p(addr) || kstack::guard_p(tss_entry.esp)) {
+    console.printf("Kernel stack overflow at %p (eip %p)\n",
+                   addr, tss_entry.eip);
+    PANIC("Kernel stack overflow");
+  }
+
+  console.printf("Double fault (eip %p, esp %p, cr2 %p)\n",
+                 tss_entry.eip, tss_entry.esp, addr);
+  PANIC("Double fault");
+
+  for(;;) cpu::halt();
+}
+
+static void write_double_fault_tss(s32int num) {
+  u32int base = (u32int)&double_fault_tss;
+
+  // Present, ring 0, available 32 bit TSS.
+  gdt_set_gate(num, base, sizeof(double_fault_tss) - 1, 0x89, 0x00);
+
+  memset((u8int*)&double_fault_tss, 0, sizeof(double_fault_tss));
+
+  double_fault_tss.eip = (u32int)double_fault_task;
+  double_fault_tss.esp = (u32int)double_fault_stack + sizeof(double_fault_stack);
+  double_fault_tss.eflags = 0x2; // Interrupts off.
+
+  double_fault_tss.cs = segments::cKernelCS;
+  double_fault_tss.ss = double_fault_tss.ds = double_fault_tss.es =
+    double_fault_tss.gs = segments::cKernelDS;
+  double_fault_tss.fs = segments::cPerCPU;
+}
+
+void set_double_fault_directory(u32 phys) {
+  double_fault_tss.cr3 = phys;
+}
+
 static void init_idt() {
   idt_ptr.limit = sizeof(idt_entry_t) * 256 -1;
   idt_ptr.base  = (u32int)&idt_entries;
@@ -146,7 +197,12 @@ static void init_idt() {
   idt_set_gate( 5, (u32int)isr5 , 0x08, 0x8E);
   idt_set_gate( 6, (u32int)isr6 , 0x08, 0x8E);
   idt_set_gate( 7, (u32int)isr7 , 0x08, 0x8E);
-  idt_set_gate( 8, (u32int)isr8 , 0x08, 0x8E);
+  // A task gate, only for the CPU to use.
+  idt_entries[8].base_lo = 0;
+  idt_entries[8].base_hi = 0;
+  idt_entries[8].sel     = segments::cDoubleFaultTSS;
+  idt_entries[8].always0 = 0;
+  idt_entries[8].flags   = 0x85;
   idt_set_gate( 9, (u32int)isr9 , 0x08, 0x8E);
   idt_set_gate(10, (u32int)isr10, 0x08, 0x8E);
   idt_set_gate(11, (u32int)isr11, 0x08, 0x8E);
@@ -18,6 +18,7 @@ namespace segments {
   const static u32 cThreadDS = 0x2b; // 0x2b + 3 for ring 3
   const static u32 cTSS = 0x33;
   const static u32 cPerCPU = 0x38;
+  const static u32 cDoubleFaultTSS = 0x40;
 }
 
 extern "C" {
@@ -33,6 +34,10 @@ void init_descriptor_tables();
 // Allows the kernel stack in the TSS to be changed.
 void set_kernel_stack(u32int stack);
 
+// The page directory the double fault task runs on. Has to be set
+// once paging is on.
+void set_double_fault_directory(u32 phys);
+
 // This structure contains the value of one GDT entry.
 // We use the attribute 'packed' to tell GCC not to change
 // any of the alignment in the structure.
@@ -0,0 +1,50 @@
+#include "dma.hpp"
+#include "buddy.hpp"
+#include "cpu.hpp"
+#include "reclaim.hpp"
+#include "vmalloc.hpp"
+
+namespace dma {
+  bool alloc(u32 size, Region* region, u32 align, u32 boundary) {
+    if(size == 0) return false;
+
+    // A buddy block is aligned to its own size, so one big enough for
+    // the alignment is aligned too, and one no bigger than the
+    // boundary can't straddle it.
+    u32 pages = cpu::page_align(size) / cpu::cPageSize;
+    if(align > pages * cpu::cPageSize) pages = align / cpu::cPageSize;
+
+    u32 order = BuddyAllocator::order_for(pages);
+    u32 bytes = (1 << order) * cpu::cPageSize;
+
+    if(order > BuddyAllocator::cMaxOrder) return false;
+    if(boundary && bytes > boundary) return false;
+
+    u32 frame;
+    if(!reclaim::alloc(order, &frame)) return false;
+
+    void* virt = vmalloc::map(frame, 1 << order);
+
+    if(!virt) {
+      frames.free(frame, order);
+      return false;
+    }
+
+    memset((u8*)virt, 0, bytes);
+
+    region->virt = (u32)virt;
+    region->phys = frame * cpu::cPageSize;
+    region->size = bytes;
+    region->order = order;
+
+    return true;
+  }
+
+  void free(Region* region) {
+    vmalloc::unmap((void*)region->virt);
+    frames.free(region->phys / cpu::cPageSize, region->order);
+
+    region->virt = 0;
+    region->phys = 0;
+  }
+}
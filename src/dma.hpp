@@ -0,0 +1,26 @@
+#ifndef DMA_HPP
+#define DMA_HPP
+
+#include "common.hpp"
+
+// Memory a device reads or writes on its own. It is one run of
+// physical frames, so the device can be given a single address, and
+// it is mapped into vmalloc space so the kernel can get at it too.
+namespace dma {
+  struct Region {
+    u32 virt;
+    u32 phys;
+    u32 size;
+    u32 order;
+  };
+
+  // Allocate size bytes, zeroed, with phys aligned to align bytes and
+  // not crossing a multiple of boundary (0 means no limit). Both must
+  // be powers of two. Returns false if the constraints can't be met.
+  bool alloc(u32 size, Region* region,
+             u32 align=0x1000, u32 boundary=0);
+
+  void free(Region* region);
+}
+
+#endif
@@ -81,8 +81,37 @@ namespace elf {
     , new_esp_(0)
     , target_ip_(0)
     , base_address_(0)
+    , replaced_(false)
   {}
 
+  Loader::~Loader() {
+    if(interp_req_) {
+      kfree((void*)interp_req_->path);
+      kfree(interp_req_);
+    }
+  }
+
+  // A copy of a NULL terminated string table in one kernel allocation,
+  // the pointers followed by the strings.
+  static const char** copy_table(const char** tbl) {
+    TableInfo info(tbl);
+
+    char** copy = (char**)kmalloc(info.total_size());
+    char* pos = (char*)copy + info.table_size;
+
+    for(u32 i = 0; i < info.entries; i++) {
+      u32 len = strlen(tbl[i]) + 1;
+      memcpy((u8*)pos, (const u8*)tbl[i], len);
+
+      copy[i] = pos;
+      pos += len;
+    }
+
+    copy[info.entries] = 0;
+
+    return (const char**)copy;
+  }
+
   Header* Loader::load_header() {
     if(req_.node->length < sizeof(Header)) {
       console.printf("Invalid elf header (size).\n");
@@ -117,6 +146,17 @@ namespace elf {
         elf::Request* req = new(kheap) elf::Request((const char*)path, 0, 0);
 
         if(!req->load_file()) {
+          kfree(path);
+          kfree(req);
+          return false;
+        }
+
+        // Nothing has been torn down yet, so turn a bad one down now.
+        Loader loader(*req);
+        own<Header*> interp_hdr = loader.load_lib_header();
+
+        if(!interp_hdr) {
+          kfree(path);
           kfree(req);
           return false;
         }
@@ -322,37 +362,65 @@ namespace elf {
     auxv[15] = 0;
   }
 
-  bool Loader::load_as_lib(Process* proc) {
+  Header* Loader::load_lib_header() {
     Header* hdr = load_header();
-    if(!hdr) return false;
+    if(!hdr) return 0;
 
     // No program headers O_o.
-    if(hdr->e_phnum == 0) return false;
-    
+    if(hdr->e_phnum == 0) {
+      kfree(hdr);
+      return 0;
+    }
+
+    return hdr;
+  }
+
+  bool Loader::load_as_lib(Process* proc) {
+    own<Header*> hdr = load_lib_header();
+    if(!hdr) return false;
+
     target_ip_ = map_lib_memory(hdr, proc);
 
     return true;
   }
 
   bool Loader::load_into(Process* proc) {
-    Header* hdr = load_header();
+    own<Header*> hdr = load_header();
     if(!hdr) return false;
 
     target_ip_ = hdr->e_entry;
 
     if(!setup_interp(hdr, proc)) return false;
 
+    // The arguments live in the image that's about to go.
+    own<const char**> argv = copy_table(req_.argv);
+    own<const char**> env = copy_table(req_.env);
+
+    req_.argv = argv;
+    req_.env = env;
+
+    proc->clear_address_space();
+    replaced_ = true;
+
     map_memory(hdr, proc);
 
     // Setting up the interpreter may change target_ip_
-    load_interp(proc);
+    if(!load_interp(proc)) {
+      req_.argv = 0;
+      req_.env = 0;
+      return false;
+    }
 
     setup_args(hdr);
 
     u32 stack_fin = stack_top() - USER_STACK_SIZE;
 
-    scheduler.process()->add_mmap(0, 0, 0, stack_fin, USER_STACK_SIZE,
-                                MemoryMapping::eAll);
+    proc->add_mmap(0, 0, 0, stack_fin, USER_STACK_SIZE, MemoryMapping::eAll);
+
+    proc->trim_tables();
+
+    req_.argv = 0;
+    req_.env = 0;
 
     return true;
   }
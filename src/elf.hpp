@@ -281,8 +281,14 @@ namespace elf {
     u32 base_address_;
     u32 interp_base_address_;
 
+    bool replaced_;
+
   public:
     Loader(Request& req);
+    ~Loader();
+
+    // Replaces the process's image. Once the old one is gone there's
+    // no going back, so everything that can fail is checked first.
     bool load_into(Process* proc);
     bool load_as_lib(Process* proc);
 
@@ -307,8 +313,14 @@ namespace elf {
       return base_address_;
     }
 
+    // True once load_into has dropped the old image, failed or not.
+    bool replaced_p() {
+      return replaced_;
+    }
+
   private:
     Header* load_header();
+    Header* load_lib_header();
     void map_memory(Header* hdr, Process* proc);
     u32 map_lib_memory(Header* hdr, Process* proc);
     void setup_args(Header* hdr);
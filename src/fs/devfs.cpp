@@ -46,11 +46,19 @@ namespace devfs {
     node->delegate = 0;
     node->next = 0;
 
+    append(node);
+  }
+
+  void DevFS::append(Node* node) {
     if(!head_) {
       head_ = node;
-    } else {
-      head_->next = node;
+      return;
     }
+
+    Node* tail = head_;
+    while(tail->next) tail = tail->next;
+
+    tail->next = node;
   }
 
   void DevFS::add_char_device(character::Device* dev, const char* name) {
@@ -71,11 +79,7 @@ namespace devfs {
     node->delegate = 0;
     node->next = 0;
 
-    if(!head_) {
-      head_ = node;
-    } else {
-      head_->next = node;
-    }
+    append(node);
   }
 
   u32 BlockNode::read(u32 offset, u32 size, u8* buffer) {
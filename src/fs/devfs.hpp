@@ -61,6 +61,8 @@ namespace devfs {
 
     RegisteredFS* fs_;
 
+    void append(Node* node);
+
   public:
 
     Node* head() {
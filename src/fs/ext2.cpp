@@ -5,12 +5,32 @@
 
 #include "block_region.hpp"
 #include "block_buffer.hpp"
+#include "scope.hpp"
+#include "reclaim.hpp"
 
 namespace ext2 {
+  static FS* filesystems = 0;
+
+  // The index only points into the device caches, so it has to go
+  // before they can give anything back. It frees next to nothing by
+  // itself.
+  static u32 shrink(u32 target) {
+    for(FS* fs = filesystems; fs; fs = fs->next()) {
+      fs->drop_block_cache();
+    }
+
+    return 0;
+  }
+
+  static reclaim::Shrinker shrinker = {
+    "ext2-index", shrink, reclaim::eIndexes, true, 0, 0
+  };
 
   void init() {
     RegisteredFS* fs = new(kheap) RegisteredFS("ext2");
     fs::registry.add_fs(fs);
+
+    reclaim::add(&shrinker);
   }
 
   fs::Node* RegisteredFS::load(block::Device* dev) {
@@ -19,6 +39,8 @@ namespace ext2 {
     FS* fs = new(kheap) FS(dev);
     if(fs->read_superblock()) {
       fs->print_description();
+      fs->set_next(filesystems);
+      filesystems = fs;
       return fs->root();
     }
 
@@ -93,6 +115,7 @@ namespace ext2 {
 
   FS::FS(block::Device* dev)
     : device_(dev)
+    , next_(0)
   {
     // Sensible defaults, changed when the superblock is read.
     block_per_region_ = 1;
@@ -105,6 +128,38 @@ namespace ext2 {
     super_block_->print_features();
   }
 
+  u32 FS::drop_block_cache() {
+    u32 dropped = 0;
+
+    // Someone is filling the index, maybe further up our own stack.
+    // Its pins keep the buffers safe until next time.
+    if(!block_cache_lock_.try_lock()) return 0;
+
+    BufferCache::Iterator i = block_cache_.iterator();
+
+    while(auto entry = i.next()) {
+      entry->value->unpin();
+    }
+
+    dropped = block_cache_.size();
+    block_cache_.clear();
+
+    block_cache_lock_.unlock();
+
+    return dropped;
+  }
+
+  // The index holds a pin of its own on each buffer in it.
+  void FS::remember_block(sys::Pair<u32,u32> key, block::Buffer* buffer) {
+    synchronized(block_cache_lock_) {
+      block::Buffer* existing;
+      if(block_cache_.fetch(key, &existing)) return;
+
+      buffer->pin();
+      block_cache_.store(key, buffer);
+    }
+  }
+
   block::Buffer* FS::async_read_block(u32 block, u32 count) {
     block::RegionRange range(b2r(block), b2r(count));
     block::Buffer* buffer = device_->request(range);
@@ -127,14 +182,18 @@ namespace ext2 {
 
     auto key = sys::pair(inode, block);
 
-    if(block_cache_.fetch(key, &buffer)) {
-      return buffer;
+    synchronized(block_cache_lock_) {
+      if(block_cache_.fetch(key, &buffer)) {
+        buffer->touch();
+        buffer->pin();
+        return buffer;
+      }
     }
 
     // Read the block id directly.
     if(block < NumDirectBlocks) {
       buffer = read_block(obj->blocks[block]);
-      block_cache_.store(key, buffer);
+      remember_block(key, buffer);
       return buffer;
     }
 
@@ -145,10 +204,11 @@ namespace ext2 {
       buffer = read_block(obj->blocks[eIndirectBlock]);
 
       id = buffer->index<u32>(block);
+      buffer->unpin();
       if(!id) return 0;
 
       buffer = read_block(id);
-      block_cache_.store(key, buffer);
+      remember_block(key, buffer);
       return buffer;
     }
 
@@ -159,15 +219,17 @@ namespace ext2 {
       buffer = read_block(obj->blocks[eDoubleIndirectBlock]);
 
       id = buffer->index<u32>(block / ids_per_block_);
+      buffer->unpin();
       if(!id) return 0;
 
       buffer = read_block(id);
 
       id = buffer->index<u32>(block % ids_per_block_);
+      buffer->unpin();
       if(!id) return 0;
 
       buffer = read_block(id);
-      block_cache_.store(key, buffer);
+      remember_block(key, buffer);
       return buffer;
     }
 
@@ -176,20 +238,23 @@ namespace ext2 {
     buffer = read_block(obj->blocks[eTripleIndirectBlock]);
 
     id = buffer->index<u32>(block / ids_per_second_level_);
+    buffer->unpin();
     if(!id) return 0;
 
     buffer = read_block(id);
 
     id = buffer->index<u32>(block / ids_per_block_);
+    buffer->unpin();
     if(!id) return 0;
 
     buffer = read_block(id);
 
     id = buffer->index<u32>(block % ids_per_block_);
+    buffer->unpin();
     if(!id) return 0;
 
     buffer = read_block(id);
-    block_cache_.store(key, buffer);
+    remember_block(key, buffer);
     return buffer;
   }
 
@@ -205,6 +270,8 @@ namespace ext2 {
     block::Buffer* buffer = read_block(2, total_groups_);
 
     memcpy((u8*)groups_, buffer->data(), table_size);
+    buffer->unpin();
+
     return groups_;
   }
 
@@ -219,6 +286,7 @@ namespace ext2 {
     buffer->wait();
 
     memcpy((u8*)sb, buffer->data(), sizeof(SuperBlock));
+    buffer->unpin();
 
     if(!sb->validate()) return 0;
 
@@ -271,6 +339,7 @@ namespace ext2 {
     block::Buffer* buffer = fs_->read_inode_block(inode, obj, cur_block++);
 
     memcpy((u8*)user, buffer->data() + initial_offset, b1_size);
+    buffer->unpin();
 
     u32 left = size - b1_size;
 
@@ -284,6 +353,7 @@ namespace ext2 {
       buffer = fs_->read_inode_block(inode, obj, cur_block++);
 
       memcpy((u8*)user, buffer->data(), read_size);
+      buffer->unpin();
 
       user += read_size;
       left -= read_size;
@@ -340,14 +410,16 @@ namespace ext2 {
     u32 block = group->inode_table + (adj_inode / inode_per_block());
     u32 block_offset = adj_inode % inode_per_block();
 
-    block::Buffer* buffer = read_block(block);
-
     Inode* inode_obj = (Inode*)kmalloc(super_block_->inode_size);
 
+    block::Buffer* buffer = read_block(block);
+
     memcpy((u8*)inode_obj,
            buffer->data() + (block_offset * super_block_->inode_size),
            super_block_->inode_size);
 
+    buffer->unpin();
+
     return inode_obj;
   }
 
@@ -373,15 +445,23 @@ namespace ext2 {
       DirEntry* dir = (DirEntry*)entries;
 
       if(!strncmp(dir->name, name, len)) {
-        Node* node = fs_->find_in_use(dir->inode);
+        u32 ino = dir->inode;
+        u8 name_len = dir->name_len;
+
+        char found[256];
+        memcpy((u8*)found, (u8*)dir->name, name_len);
+
+        buffer->unpin();
+
+        Node* node = fs_->find_in_use(ino);
         if(node) return node;
 
-        Inode* target = fs_->find_inode(dir->inode);
+        Inode* target = fs_->find_inode(ino);
 
         node = new(kheap) Node;
 
-        memcpy((u8*)node->name, (u8*)dir->name, dir->name_len);
-        node->name[dir->name_len] = 0;
+        memcpy((u8*)node->name, (u8*)found, name_len);
+        node->name[name_len] = 0;
 
         node->mask = 0;
         node->uid = target->uid;
@@ -393,13 +473,13 @@ namespace ext2 {
           node->flags = FS_FILE;
         }
 
-        node->inode = dir->inode;
+        node->inode = ino;
         node->length = target->size;
 
         node->delegate = 0;
         node->fs_ = fs_;
 
-        fs_->make_in_use(dir->inode, node);
+        fs_->make_in_use(ino, node);
 
         return node;
       }
@@ -407,6 +487,7 @@ namespace ext2 {
       entries += dir->rec_len;
     }
 
+    buffer->unpin();
     return 0;
   }
   
@@ -5,6 +5,7 @@
 #include "block.hpp"
 #include "fs.hpp"
 #include "pair.hpp"
+#include "spinlock.hpp"
 
 namespace ext2 {
 
@@ -337,14 +338,28 @@ namespace ext2 {
     typedef sys::IdentityHash<u32, Node*> Nodes;
     typedef sys::OOHash<sys::Pair<u32,u32>, block::Buffer*> BufferCache;
 
+    void remember_block(sys::Pair<u32,u32> key, block::Buffer* buffer);
+
     Nodes nodes_in_use_;
     BufferCache block_cache_;
+    SpinLock block_cache_lock_;
+
+    // All mounted filesystems, for the reclaimer.
+    FS* next_;
 
   public:
     block::Device* device() {
       return device_;
     }
 
+    FS* next() {
+      return next_;
+    }
+
+    void set_next(FS* fs) {
+      next_ = fs;
+    }
+
     u32 b2r(u32 block) {
       return block * block_per_region_;
     }
@@ -376,6 +391,11 @@ namespace ext2 {
 
     FS(block::Device* dev);
 
+    // Forget the inode block index so the device cache can let go of
+    // the buffers. Returns the number of entries dropped.
+    u32 drop_block_cache();
+
+    // These hand back pinned buffers, see Device::request.
     block::Buffer* async_read_block(u32 block, u32 count=1);
     block::Buffer* read_block(u32 block, u32 count=1);
     block::Buffer* read_inode_block(u32 inode, Inode* obj, u32 block);
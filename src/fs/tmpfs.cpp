@@ -1,5 +1,7 @@
 #include "fs/tmpfs.hpp"
 #include "kheap.hpp"
+#include "vmalloc.hpp"
+#include "page_cache.hpp"
 
 namespace tmpfs {
   void init() {
@@ -156,26 +158,41 @@ namespace tmpfs {
   u32 FileNode::write(u32 offset, u32 size, u8* buffer) {
     ASSERT(offset + size < size_);
     memcpy(chunk_ + offset, buffer, size);
+
+    page_cache::invalidate(this, offset, size);
     return size;
   }
 
   void FileNode::import_raw(u8* buf, u32 size) {
-    if(size > size_) {
-      kfree(chunk_);
-      chunk_ = (u8*)kmalloc(size);
-      size_ = size;
-    }
-
+    resize(size);
     memcpy(chunk_, buf, size);
+
+    // All new contents.
+    page_cache::drop(this);
   }
 
   u8* FileNode::resize(u32 size) {
-    if(size > size_) {
-      kfree(chunk_);
-      chunk_ = (u8*)kmalloc(size);
-      size_ = size;
+    if(size <= size_) return chunk_;
+
+    if(vmalloc::contains_p(chunk_)) {
+      chunk_ = (u8*)vmalloc::realloc(chunk_, size);
+    } else if(size < cLargeFileSize) {
+      chunk_ = (u8*)krealloc_vp(chunk_, size);
+    } else {
+      // Big files move out of the heap for good.
+      u8* chunk = (u8*)vmalloc::alloc(size);
+
+      if(chunk) {
+        memcpy(chunk, chunk_, size_);
+        kfree(chunk_);
+      }
+
+      chunk_ = chunk;
     }
 
+    if(!chunk_) PANIC("Out of memory for tmpfs file");
+
+    size_ = size;
     return chunk_;
   }
 }
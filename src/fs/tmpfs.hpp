@@ -27,6 +27,9 @@ namespace tmpfs {
   public:
     static const u32 cInitialChunkSize = 1024;
 
+    // Files at least this big are kept in vmalloc space.
+    static const u32 cLargeFileSize = 64 * 1024;
+
     FileNode(FS* fs);
 
     u32 read(u32 offset, u32 size, u8* buffer);
@@ -59,18 +59,12 @@ namespace sys {
 
         while(entry) {
           Entry* link = entry->next;
-          entry->next = 0;
 
           u32 hash = Operations::compute_hash(entry->key);
           u32 bin = find_bin(hash, size);
 
-          Entry* slot = new_values[bin];
-
-          if(slot) {
-            slot->next = entry;
-          } else {
-            new_values[bin] = entry;
-          }
+          entry->next = new_values[bin];
+          new_values[bin] = entry;
 
           entry = link;
         }
@@ -133,7 +127,7 @@ namespace sys {
     }
 
     bool remove(Key key) {
-      if(min_density_p()) {
+      if(min_density_p() && bins_ > MinSize) {
         redistribute(bins_ >> 1);
       }
 
@@ -164,6 +158,27 @@ namespace sys {
       return false;
     }
 
+    // Drop every entry, keeping the bins.
+    void clear() {
+      for(u32 i = 0; i < bins_; i++) {
+        Entry* entry = values_[i];
+
+        while(entry) {
+          Entry* next = entry->next;
+          kfree(entry);
+          entry = next;
+        }
+
+        values_[i] = 0;
+      }
+
+      entries_ = 0;
+    }
+
+    u32 size() {
+      return entries_;
+    }
+
     class Iterator {
       HashTable& tbl_;
       u32 bin_;
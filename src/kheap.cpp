@@ -7,6 +7,11 @@
 #include "paging.hpp"
 #include "console.hpp"
 #include "cpu.hpp"
+#include "slab.hpp"
+#include "kheap_profile.hpp"
+#include "reclaim.hpp"
+#include "buddy.hpp"
+#include "kpages.hpp"
 
 Heap* kheap = 0;
 
@@ -29,51 +34,106 @@ Allocation Heap::allocate(u32 size, int align=0) {
 
 extern "C" {
 
-u32 kmalloc_int(u32 sz, int align, u32 *phys) {
+// The allocation wrappers all pass their own caller along, so the
+// profiler sees who really asked.
+static u32 kmalloc_from(u32 sz, int align, u32 *phys, void* caller,
+                        bool zero=false)
+{
   ASSERT(kheap);
 
   if(align && sz < 0x1000) {
     sz = 0x1000;
   }
 
-  void *addr = kheap->alloc(sz, (u8)align);
-  if(phys != 0) {
-    x86::Page* page = vmem.get_kernel_page((u32)addr, false);
-    *phys = page->frame*0x1000 + ((u32)addr&0xFFF);
+  void *addr = 0;
+
+  // Small unaligned requests are served from the size classes, and
+  // aligned ones of a few pages get whole frames. The Heap only sees
+  // what's left, so it isn't cut up at page boundaries. The size
+  // classes don't fill in *phys, so callers after one go to the Heap.
+  if(!align) {
+    if(!phys) addr = slab::alloc(sz);
+  } else {
+    addr = kpages::alloc(sz, phys, zero);
+    if(addr) zero = false;
+  }
+
+  if(!addr) {
+    addr = kheap->alloc(sz, (u8)align);
+
+    if(phys != 0) {
+      *phys = vmem.physical_address((u32)addr);
+    }
   }
 
+  if(zero) memset((u8*)addr, 0, sz);
+
+  kheap_profile::record(addr, sz, caller);
+
   return (u32)addr;
 }
 
+u32 kmalloc_int(u32 sz, int align, u32 *phys) {
+  return kmalloc_from(sz, align, phys, __builtin_return_address(0));
+}
+
 void kfree(void *p) {
-  kheap->free(p);
+  kheap_profile::forget(p);
+
+  if(slab::contains_p(p)) {
+    slab::free(p);
+  } else if(kpages::contains_p(p)) {
+    kpages::free(p);
+  } else {
+    kheap->free(p);
+  }
 }
 
 u32 kmalloc_a(u32 sz) {
-  return kmalloc_int(sz, 1, 0);
+  return kmalloc_from(sz, 1, 0, __builtin_return_address(0));
 }
 
 void* kmalloc_vp(int sz) {
-  void* p = (void*)kmalloc_int(sz, 0, 0);
+  void* p = (void*)kmalloc_from(sz, 0, 0, __builtin_return_address(0));
   return p;
 }
 
 void* krealloc_vp(void* ptr, int sz) {
-  void* new_ptr = kmalloc_vp(sz);
-  memcpy((u8*)new_ptr, (const u8*)ptr, sz);
+  if(!ptr) return (void*)kmalloc_from(sz, 0, 0, __builtin_return_address(0));
+
+  if(slab::contains_p(ptr)) {
+    u32 have = slab::object_size(ptr);
+
+    // It still fits in its size class.
+    if((u32)sz <= have) return ptr;
+
+    void* new_ptr = (void*)kmalloc_from(sz, 0, 0, __builtin_return_address(0));
+    memcpy((u8*)new_ptr, (const u8*)ptr, have);
+    kfree(ptr);
+    return new_ptr;
+  }
+
+  kheap_profile::forget(ptr);
+  void* new_ptr = kheap->realloc(ptr, sz);
+  kheap_profile::record(new_ptr, sz, __builtin_return_address(0));
+
   return new_ptr;
 }
 
 u32 kmalloc_p(u32 sz, u32 *phys) {
-  return kmalloc_int(sz, 0, phys);
+  return kmalloc_from(sz, 0, phys, __builtin_return_address(0));
 }
 
 u32 kmalloc_ap(u32 sz, u32 *phys) {
-  return kmalloc_int(sz, 1, phys);
+  return kmalloc_from(sz, 1, phys, __builtin_return_address(0));
+}
+
+u32 kmalloc_apz(u32 sz, u32 *phys) {
+  return kmalloc_from(sz, 1, phys, __builtin_return_address(0), true);
 }
 
 u32 kmalloc(u32 sz) {
-  return kmalloc_int(sz, 0, 0);
+  return kmalloc_from(sz, 0, 0, __builtin_return_address(0));
 }
 
 static void expand(u32 new_size, Heap *heap) {
@@ -81,10 +141,7 @@ static void expand(u32 new_size, Heap *heap) {
   ASSERT(new_size > heap->end_address - heap->start_address);
 
   // Get the nearest following page boundary.
-  if((new_size & 0xFFFFF000) != 0) {
-    new_size &= 0xFFFFF000;
-    new_size += 0x1000;
-  }
+  new_size = cpu::page_align(new_size);
 
   // Make sure we are not overreaching ourselves.
   ASSERT(heap->start_address+new_size <= heap->max_address);
@@ -94,11 +151,19 @@ static void expand(u32 new_size, Heap *heap) {
 
   u32 i = old_size;
   while(i < new_size) {
-    vmem.alloc_frame(
-        vmem.get_kernel_page(heap->start_address+i, true),
-        (heap->supervisor)?1:0,
-        (heap->readonly)?0:1
-    );
+    x86::Page* page = vmem.get_kernel_page(heap->start_address+i, true);
+
+    // Pages inside the 4M linear mapping are always there.
+    if(page) {
+      vmem.alloc_frame(page,
+          (heap->supervisor)?1:0,
+          (heap->readonly)?0:1
+      );
+
+      // The heap is mapped in every directory.
+      page->global = 1;
+    }
+
     i += 0x1000 /* page size */;
   }
 
@@ -106,79 +171,170 @@ static void expand(u32 new_size, Heap *heap) {
 }
 
 static u32 contract(u32 new_size, Heap *heap) {
-  // Sanity check.
-  ASSERT(new_size < heap->end_address-heap->start_address);
-
   // Get the nearest following page boundary.
-  if(new_size&0x1000) {
-    new_size &= 0x1000;
-    new_size += 0x1000;
-  }
+  new_size = cpu::page_align(new_size);
 
   // Don't contract too far!
   if(new_size < HEAP_MIN_SIZE) new_size = HEAP_MIN_SIZE;
 
   u32 old_size = heap->end_address-heap->start_address;
-  u32 i = old_size - 0x1000;
-  while(new_size < i) {
-    vmem.free_frame(vmem.get_kernel_page(heap->start_address+i, false));
-    i -= 0x1000;
+  if(new_size >= old_size) return old_size;
+
+  for(u32 i = new_size; i < old_size; i += cpu::cPageSize) {
+    x86::Page* page = vmem.get_kernel_page(heap->start_address+i, false);
+
+    // The 4M linear mapping can't give back single pages.
+    if(!page) continue;
+
+    vmem.free_frame(page);
+    cpu::invalidate_page(heap->start_address+i);
   }
 
   heap->end_address = heap->start_address + new_size;
   return new_size;
 }
 
-static s32 find_smallest_hole(u32 size, u8 page_align, Heap *heap) {
-  // Find the smallest hole that will fit.
-  u32 iterator = 0;
-  while(iterator < heap->index.size) {
-    Heap::header *header = heap->index.lookup(iterator);
-    // If the user has requested the memory be page-aligned
-    if(page_align > 0) {
-      // Page-align the starting point of this header.
-      u32 location = (u32)header;
-      s32 offset = 0;
-      if(((location+sizeof(Heap::header)) & 0xFFFFF000) != 0) {
-        offset = cpu::cPageSize - (location+sizeof(Heap::header))%0x1000;
-      }
-      s32 hole_size = (s32)header->size - offset;
-      // Can we fit now?
-      if(hole_size >= (s32)size) break;
-    } else if (header->size >= size) {
-      break;
+// Map a hole size to the list that holds holes of that size.
+static inline void mapping_insert(u32 size, u32* fl, u32* sl) {
+  u32 f = 31 - __builtin_clz(size);
+
+  *fl = f;
+  if(f < Heap::cSecondLevelLog2) {
+    *sl = 0;
+  } else {
+    *sl = (size >> (f - Heap::cSecondLevelLog2)) & (Heap::cSecondLevels - 1);
+  }
+}
+
+// Like mapping_insert, but rounds up to the next list so that any hole
+// found there is guaranteed to be big enough.
+static inline void mapping_search(u32 size, u32* fl, u32* sl) {
+  u32 f = 31 - __builtin_clz(size);
+
+  if(f >= Heap::cSecondLevelLog2) {
+    size += (1 << (f - Heap::cSecondLevelLog2)) - 1;
+  }
+
+  mapping_insert(size, fl, sl);
+}
+
+static inline void write_footer(Heap::header* header) {
+  Heap::footer *footer = (Heap::footer*) ( (u32)header + header->size - sizeof(Heap::footer) );
+  footer->magic = HEAP_MAGIC;
+  footer->hdr = header;
+}
+
+static inline void make_hole(Heap::header* header, u32 size) {
+  header->magic = HEAP_MAGIC;
+  header->is_hole = 1;
+  header->size = size;
+  header->next = header->prev = 0;
+  write_footer(header);
+}
+
+void Heap::insert_hole(Heap::header* hole) {
+  u32 fl, sl;
+  mapping_insert(hole->size, &fl, &sl);
+
+  hole->prev = 0;
+  hole->next = holes[fl][sl];
+  if(hole->next) hole->next->prev = hole;
+  holes[fl][sl] = hole;
+
+  first_bitmap |= (1 << fl);
+  second_bitmap[fl] |= (1 << sl);
+
+  hole_count++;
+}
+
+void Heap::remove_hole(Heap::header* hole) {
+  u32 fl, sl;
+  mapping_insert(hole->size, &fl, &sl);
+
+  if(hole->next) hole->next->prev = hole->prev;
+
+  if(hole->prev) {
+    hole->prev->next = hole->next;
+  } else {
+    holes[fl][sl] = hole->next;
+
+    if(!holes[fl][sl]) {
+      second_bitmap[fl] &= ~(1 << sl);
+      if(!second_bitmap[fl]) first_bitmap &= ~(1 << fl);
     }
-    iterator++;
   }
-  // Why did the loop exit?
-  if(iterator == heap->index.size) {
-    return -1; // We got to the end and didn't find anything.
+
+  hole->next = hole->prev = 0;
+
+  hole_count--;
+}
+
+Heap::header* Heap::find_hole(u32 size) {
+  u32 fl, sl;
+  mapping_search(size, &fl, &sl);
+
+  if(fl >= cFirstLevels) return 0;
+
+  u32 sl_map = second_bitmap[fl] & (~0U << sl);
+
+  if(!sl_map) {
+    // Nothing big enough at this power of two, take the next one up.
+    if(fl + 1 >= cFirstLevels) return 0;
+
+    u32 fl_map = first_bitmap & (~0U << (fl + 1));
+    if(!fl_map) return 0;
+
+    fl = __builtin_ffs(fl_map) - 1;
+    sl_map = second_bitmap[fl];
+  }
+
+  sl = __builtin_ffs(sl_map) - 1;
+
+  return holes[fl][sl];
+}
+
+// Expand the heap so that it ends in a hole of at least size bytes.
+void Heap::grow(u32 size) {
+  u32 old_end = end_address;
+
+  // If the block at the end is a hole, it only needs extending.
+  Heap::footer* last_footer = (Heap::footer*)(end_address - sizeof(Heap::footer));
+  Heap::header* last = 0;
+
+  if(last_footer->magic == HEAP_MAGIC && last_footer->hdr->is_hole) {
+    last = last_footer->hdr;
+  }
+
+  u32 have = last ? last->size : 0;
+
+  growing = 1;
+  expand(end_address - start_address + (size - have), this);
+  growing = 0;
+
+  if(last) {
+    remove_hole(last);
+    last->size += end_address - old_end;
+    write_footer(last);
+    insert_hole(last);
   } else {
-    return iterator;
+    Heap::header* hole = (Heap::header*)old_end;
+    make_hole(hole, end_address - old_end);
+    insert_hole(hole);
   }
 }
 
 Heap* Heap::create(u32 start, u32 end_addr, u32 max, u8 supervisor, u8 readonly) {
   Heap* heap = (Heap*)start;
 
+  memset((u8*)heap, 0, sizeof(Heap));
+
+  // Data starts on the first page after the heap structure.
   start = cpu::page_align(start + sizeof(Heap));
 
   // All our assumptions are made on startAddress and endAddress being page-aligned.
   ASSERT(start%0x1000 == 0);
   ASSERT(end_addr%0x1000 == 0);
 
-  // Initialise the index.
-  heap->index = place_ordered_array<Heap::header*, Heap::header>((void*)start, HEAP_INDEX_SIZE);
-
-  // Shift the start address forward to resemble where we can start putting data.
-  start += sizeof(void*)*HEAP_INDEX_SIZE;
-
-  // Make sure the start address is page-aligned.
-  if((start & 0xFFFFF000) != 0) {
-    start &= 0xFFFFF000;
-    start += 0x1000;
-  }
-
   // Write the start, end and max addresses into the heap structure.
   heap->start_address = start;
   heap->end_address = end_addr;
@@ -188,133 +344,181 @@ Heap* Heap::create(u32 start, u32 end_addr, u32 max, u8 supervisor, u8 readonly)
 
   // We start off with one large hole in the index.
   Heap::header *hole = (Heap::header *)start;
-  hole->size = end_addr-start;
-  hole->magic = HEAP_MAGIC;
-  hole->is_hole = 1;
-  heap->index.insert(hole);
+  make_hole(hole, end_addr-start);
+  heap->insert_hole(hole);
 
   return heap;
 }
 
 void* Heap::alloc(u32 size, u8 page_align) {
   // Make sure we take the size of header/footer into account.
-  u32 new_size = size + sizeof(Heap::header) + sizeof(Heap::footer);
-
-  // Find the smallest hole that will fit.
-  s32 iterator = find_smallest_hole(new_size, page_align, this);
-
-  if(iterator == -1) { // If we didn't find a suitable hole
-    // Save some previous data.
-    u32 old_length = end_address - start_address;
-    u32 old_end_address = end_address;
-
-    // We need to allocate some more space.
-    expand(old_length+new_size, this);
-    u32 new_length = end_address-start_address;
-
-    // Find the endmost header. (Not endmost in size, but in location).
-    iterator = 0;
-    // Vars to hold the index of, and value of, the endmost header found so far.
-    u32 idx = -1;
-    u32 value = 0x0;
-
-    while((u32)iterator < index.size) {
-      u32 tmp = (u32)index.lookup(iterator);
-      if(tmp > value) {
-        value = tmp;
-        idx = iterator;
-      }
-      iterator++;
-    }
+  u32 new_size = align(size, sizeof(void*)) + sizeof(Heap::header) + sizeof(Heap::footer);
 
-    // If we didn't find ANY headers, we need to add one.
-    if((s32)idx == -1) {
-      Heap::header *header = (Heap::header *)old_end_address;
-      header->magic = HEAP_MAGIC;
-      ASSERT(old_length > new_length);
-      header->size = new_length - old_length;
-      header->is_hole = 1;
-      Heap::footer *footer = (Heap::footer *) (old_end_address + header->size - sizeof(Heap::footer));
-      footer->magic = HEAP_MAGIC;
-      footer->hdr = header;
-      index.insert(header);
-    } else {
-      // The last header needs adjusting.
-      Heap::header *header = index.lookup(idx);
-      ASSERT(new_length > old_length);
-      header->size += new_length - old_length;
-      // Rewrite the footer.
-      Heap::footer *footer = (Heap::footer *) ( (u32)header + header->size - sizeof(Heap::footer) );
-      footer->hdr = header;
-      footer->magic = HEAP_MAGIC;
-    }
-    // We now have enough space. Recurse, and call the function again.
-    return alloc(size, page_align);
-  }
+  // An aligned block may need a hole carved in front of it, so look for
+  // a hole that fits it wherever it happens to start.
+  u32 search = new_size;
+  if(page_align) search += cpu::cPageSize + cMinHole;
 
-  Heap::header *orig_hole_header = index.lookup(iterator);
-  u32 orig_hole_pos = (u32)orig_hole_header;
-  u32 orig_hole_size = orig_hole_header->size;
+  Heap::header* hole = find_hole(search);
 
-  // Here we work out if we should split the hole we found into two parts.
-  // Is the original hole size - requested hole size less than the overhead for adding a new hole?
-  ASSERT(orig_hole_size >= new_size);
-  if(orig_hole_size - new_size < sizeof(Heap::header) + sizeof(Heap::footer)) {
-    // Then just increase the requested size to the size of the hole we found.
-    size += orig_hole_size-new_size;
-    new_size = orig_hole_size;
+  // Short on frames, so let the caches give some memory back before
+  // growing. What they free may well be enough to satisfy us.
+  if(!hole && frames.free_frames() < reclaim::cLowWatermark) {
+    reclaim::run(reclaim::cLowWatermark);
+    hole = find_hole(search);
+  }
+
+  if(!hole) {
+    // We need to allocate some more space, then try again.
+    grow(search + (search >> cSecondLevelLog2));
+    hole = find_hole(search);
+    ASSERT(hole);
   }
 
+  remove_hole(hole);
+
+  u32 pos = (u32)hole;
+  u32 hole_size = hole->size;
+
   // If we need to page-align the data, do it now and make a new hole in front of our block.
-  if(page_align && (orig_hole_pos & 0xFFFFF000)) {
-    u32 new_location   = orig_hole_pos + cpu::cPageSize - (orig_hole_pos&0xFFF) - sizeof(Heap::header);
-    Heap::header *hole_header = (Heap::header *)orig_hole_pos;
-    hole_header->size     = cpu::cPageSize - (orig_hole_pos&0xFFF) - sizeof(Heap::header);
-    hole_header->magic    = HEAP_MAGIC;
-    hole_header->is_hole  = 1;
-    Heap::footer *hole_footer = (Heap::footer *) ( (u32)new_location - sizeof(Heap::footer) );
-    hole_footer->magic    = HEAP_MAGIC;
-    hole_footer->hdr   = hole_header;
-    orig_hole_pos         = new_location;
-
-    ASSERT(orig_hole_size > hole_header->size);
-    orig_hole_size        = orig_hole_size - hole_header->size;
+  if(page_align) {
+    u32 data = cpu::page_align(pos + sizeof(Heap::header));
+    u32 gap = data - sizeof(Heap::header) - pos;
 
-  } else {
-    // Else we don't need this hole any more, delete it from the index.
-    index.remove(iterator);
+    if(gap > 0 && gap < cMinHole) gap += cpu::cPageSize;
+
+    if(gap > 0) {
+      Heap::header* front = (Heap::header*)pos;
+      make_hole(front, gap);
+      insert_hole(front);
+
+      pos += gap;
+      hole_size -= gap;
+    }
   }
 
-  // Overwrite the original header...
-  Heap::header *block_header  = (Heap::header *)orig_hole_pos;
+  // Here we work out if we should split the hole we found into two parts.
+  // Is the original hole size - requested hole size less than the overhead for adding a new hole?
+  ASSERT(hole_size >= new_size);
+  if(hole_size - new_size < cMinHole) {
+    // Then just increase the requested size to the size of the hole we found.
+    new_size = hole_size;
+  }
+
+  Heap::header *block_header  = (Heap::header *)pos;
   block_header->magic     = HEAP_MAGIC;
   block_header->is_hole   = 0;
   block_header->size      = new_size;
-  // ...And the footer
-  Heap::footer *block_footer  = (Heap::footer *) (orig_hole_pos + sizeof(Heap::header) + size);
-  block_footer->magic     = HEAP_MAGIC;
-  block_footer->hdr    = block_header;
+  block_header->next = block_header->prev = 0;
+  write_footer(block_header);
 
   // We may need to write a new hole after the allocated block.
-  // We do this only if the new hole would have positive size...
-  if(orig_hole_size > new_size) {
-    Heap::header *hole_header = (Heap::header *) (orig_hole_pos + sizeof(Heap::header) + size + sizeof(Heap::footer));
-    hole_header->magic    = HEAP_MAGIC;
-    hole_header->is_hole  = 1;
-    hole_header->size     = orig_hole_size - new_size;
-    Heap::footer *hole_footer = (Heap::footer *) ( (u32)hole_header + orig_hole_size - new_size - sizeof(Heap::footer) );
-    if((u32)hole_footer < end_address) {
-      hole_footer->magic = HEAP_MAGIC;
-      hole_footer->hdr = hole_header;
-    }
-    // Put the new hole in the index;
-    index.insert(hole_header);
+  if(hole_size > new_size) {
+    Heap::header *rest = (Heap::header *) (pos + new_size);
+    make_hole(rest, hole_size - new_size);
+    insert_hole(rest);
   }
 
   // ...And we're done!
   return (void *) ((u32)block_header+sizeof(Heap::header));
 }
 
+// Try to make block size bytes long without moving it, by giving the
+// tail back or by taking over the hole after it.
+bool Heap::resize(Heap::header* block, u32 new_size) {
+  u32 old_size = block->size;
+
+  if(new_size <= old_size) {
+    if(old_size - new_size < cMinHole) return true;
+
+    block->size = new_size;
+    write_footer(block);
+
+    // Turn the tail into a block of its own and free it, which merges
+    // it with whatever follows and contracts the heap if it can.
+    Heap::header* rest = (Heap::header*)((u32)block + new_size);
+    rest->magic = HEAP_MAGIC;
+    rest->is_hole = 0;
+    rest->size = old_size - new_size;
+    rest->next = rest->prev = 0;
+    write_footer(rest);
+
+    free((void*)((u32)rest + sizeof(Heap::header)));
+    return true;
+  }
+
+  u32 need = new_size - old_size;
+  Heap::header* right = (Heap::header*)((u32)block + old_size);
+
+  // At the very end, grow the heap so there's a hole to take.
+  bool at_end = (u32)right == end_address ||
+                (right->is_hole && (u32)right + right->size == end_address);
+
+  if(at_end && ((u32)right == end_address || right->size < need)) {
+    if(end_address - start_address + need + cMinHole >
+       max_address - start_address) return false;
+
+    grow(need);
+    right = (Heap::header*)((u32)block + old_size);
+  }
+
+  if((u32)right >= end_address || right->magic != HEAP_MAGIC ||
+     !right->is_hole || right->size < need) {
+    return false;
+  }
+
+  remove_hole(right);
+
+  u32 total = old_size + right->size;
+
+  if(total - new_size >= cMinHole) {
+    block->size = new_size;
+
+    Heap::header* rest = (Heap::header*)((u32)block + new_size);
+    make_hole(rest, total - new_size);
+    insert_hole(rest);
+  } else {
+    block->size = total;
+  }
+
+  write_footer(block);
+  return true;
+}
+
+void* Heap::realloc(void* p, u32 size) {
+  if(p == 0) return alloc(size, 0);
+
+  Heap::header* block = (Heap::header*)((u32)p - sizeof(Heap::header));
+  ASSERT(block->magic == HEAP_MAGIC && !block->is_hole);
+
+  u32 new_size = align(size, sizeof(void*)) + sizeof(Heap::header) + sizeof(Heap::footer);
+
+  if(resize(block, new_size)) return p;
+
+  // No room where it is, so move it.
+  u32 have = block->size - sizeof(Heap::header) - sizeof(Heap::footer);
+
+  void* new_p = alloc(size, 0);
+  memcpy((u8*)new_p, (const u8*)p, have < size ? have : size);
+  free(p);
+
+  return new_p;
+}
+
+void Heap::hole_stats(u32* counts, u32* bytes) {
+  for(u32 fl = 0; fl < cFirstLevels; fl++) {
+    counts[fl] = 0;
+    bytes[fl] = 0;
+
+    for(u32 sl = 0; sl < cSecondLevels; sl++) {
+      for(Heap::header* h = holes[fl][sl]; h; h = h->next) {
+        counts[fl]++;
+        bytes[fl] += h->size;
+      }
+    }
+  }
+}
+
 void Heap::free(void *p) {
   // Exit gracefully for null pointers.
   if (p == 0) return;
@@ -333,75 +537,47 @@ void Heap::free(void *p) {
     ASSERT(footer->magic == HEAP_MAGIC);
   }
 
+  ASSERT(!header->is_hole);
+
   // Make us a hole.
   header->is_hole = 1;
 
-  // Do we want to add this header into the 'free holes' index?
-  char do_add = 1;
-
   // Unify left
-  // If the thing immediately to the left of us is a footer...
-  Heap::footer *test_footer = (Heap::footer*) ( (u32)header - sizeof(Heap::footer) );
-  if(test_footer->magic == HEAP_MAGIC && test_footer->hdr->is_hole == 1) {
-    u32 cache_size = header->size; // Cache our current size.
-    header = test_footer->hdr;     // Rewrite our header with the new one.
-    footer->hdr = header;          // Rewrite our footer to point to the new header.
-    header->size += cache_size;       // Change the size.
-    do_add = 0;                       // Since this header is already in the index, we don't want to add it again.
+  // If the thing immediately to the left of us is a footer of a hole...
+  if((u32)header > start_address) {
+    Heap::footer *test_footer = (Heap::footer*) ( (u32)header - sizeof(Heap::footer) );
+    if(test_footer->magic == HEAP_MAGIC && test_footer->hdr->is_hole == 1) {
+      Heap::header* left = test_footer->hdr;
+      remove_hole(left);
+      left->size += header->size;
+      header = left;
+    }
   }
 
   // Unify right
-  // If the thing immediately to the right of us is a header...
+  // If the thing immediately to the right of us is a hole...
   Heap::header *test_header = (Heap::header*) ( (u32)footer + sizeof(Heap::footer) );
-  if(test_header->magic == HEAP_MAGIC && test_header->is_hole) {
-    header->size += test_header->size; // Increase our size.
-    test_footer = (Heap::footer*) ( (u32)test_header + // Rewrite it's footer to point to our header.
-        test_header->size - sizeof(Heap::footer) );
-    footer = test_footer;
-    // Find and remove this header from the index.
-    u32 iterator = 0;
-    while((iterator < index.size) &&
-        (index.lookup(iterator) != test_header)) {
-      iterator++;
-    }
-
-    // Make sure we actually found the item.
-    ASSERT(iterator < index.size);
-    // Remove it.
-    index.remove(iterator);
+  if((u32)test_header < end_address &&
+      test_header->magic == HEAP_MAGIC && test_header->is_hole) {
+    remove_hole(test_header);
+    header->size += test_header->size;
   }
 
-  // If the footer location is the end address, we can contract.
-  if((u32)footer+sizeof(Heap::footer) == end_address) {
+  write_footer(header);
+
+  // If we are the last thing in the heap, we can contract. Always leave
+  // enough behind for the hole itself.
+  if((u32)header + header->size == end_address) {
     u32 old_length = end_address-start_address;
-    u32 new_length = contract( (u32)header - start_address, this);
+    u32 new_length = contract((u32)header - start_address + cMinHole, this);
 
-    // Check how big we will be after resizing.
-    if(header->size - (old_length-new_length) > 0) {
-      // We will still exist, so resize us.
+    if(new_length < old_length) {
       header->size -= old_length-new_length;
-      footer = (Heap::footer*) ( (u32)header + header->size - sizeof(Heap::footer) );
-      footer->magic = HEAP_MAGIC;
-      footer->hdr = header;
-    } else {
-      // We will no longer exist :(. Remove us from the index.
-      u32 iterator = 0;
-      while((iterator < index.size) &&
-          (index.lookup(iterator) != test_header)) {
-        iterator++;
-      }
-      // If we didn't find ourselves, we have nothing to remove.
-      if(iterator < index.size) {
-        index.remove(iterator);
-      }
+      write_footer(header);
     }
   }
 
-  // If required, add us to the index.
-  if(do_add == 1) {
-    index.insert(header);
-  }
-
+  insert_hole(header);
 }
 
 }
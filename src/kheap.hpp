@@ -7,12 +7,10 @@
 #define KHEAP_H
 
 #include "common.hpp"
-#include "ordered_array.hpp"
 
 #define KHEAP_START         0xC0000000
 #define KHEAP_INITIAL_SIZE  0x100000
 
-#define HEAP_INDEX_SIZE   0x20000
 #define HEAP_MAGIC        0x123890AB
 #define HEAP_MIN_SIZE     0x70000
 
@@ -26,9 +24,9 @@ struct Heap {
     u8 is_hole;   // 1 if this is a hole. 0 if this is a block.
     u32 size;    // size of the block, including the end footer.
 
-    static inline bool less_than(void* a, void* b) {
-      return (((header*)a)->size < ((header*)b)->size);
-    }
+    // Links in the free list for this size, only valid for holes.
+    header* next;
+    header* prev;
   };
 
   struct footer {
@@ -36,23 +34,52 @@ struct Heap {
     header* hdr; // Pointer to the block header.
   };
 
-  ordered_array<header*, header> index;
+  // Holes are kept in segregated lists: the first level splits sizes
+  // by power of two, the second splits each power of two linearly.
+  // A bitmap per level makes finding a non-empty list O(1).
+  const static u32 cFirstLevels = 32;
+  const static u32 cSecondLevelLog2 = 4;
+  const static u32 cSecondLevels = 1 << cSecondLevelLog2;
+
+  // A hole smaller than this can't hold its own header and footer.
+  const static u32 cMinHole = sizeof(header) + sizeof(footer);
+
+  header* holes[cFirstLevels][cSecondLevels];
+  u32 first_bitmap;
+  u32 second_bitmap[cFirstLevels];
+  u32 hole_count;
+
   u32 start_address; // The start of our allocated space.
   u32 end_address;   // The end of our allocated space. May be expanded up to max_address.
   u32 max_address;   // The maximum address the heap can be expanded to.
   u8 supervisor;     // Should extra pages requested by us be mapped as supervisor-only?
   u8 readonly;       // Should extra pages requested by us be mapped as read-only?
+  u8 growing;        // Set while grow is mapping in new pages.
 
   static Heap *create(u32 start, u32 end, u32 max, u8 supervisor, u8 readonly);
   void* alloc(u32 size, u8 page_align);
   void  free(void* p);
 
+  // Resize the block at p, in place if the neighbouring memory allows
+  // it. Returns the block's possibly new location.
+  void* realloc(void* p, u32 size);
+
+  // Count the holes, and the bytes in them, for each power of two.
+  void hole_stats(u32* counts, u32* bytes);
+
   struct Allocation {
     void* virt;
     void* phys;
   };
 
   Allocation allocate(u32 size, int align=0);
+
+private:
+  void insert_hole(header* hole);
+  void remove_hole(header* hole);
+  header* find_hole(u32 size);
+  void grow(u32 size);
+  bool resize(header* block, u32 size);
 };
 
 extern Heap* kheap;
@@ -91,6 +118,12 @@ u32 kmalloc_a(u32 sz);
 
 void* kmalloc_vp(int sz);
 
+/**
+   Resize a chunk from kmalloc_vp, keeping its contents up to the
+   smaller of the two sizes. Grows and shrinks in place when it can.
+**/
+void* krealloc_vp(void* ptr, int sz);
+
 /**
    Allocate a chunk of memory, sz in size. The physical address
    is returned in phys. Phys MUST be a valid pointer to u32!
@@ -103,6 +136,11 @@ u32 kmalloc_p(u32 sz, u32 *phys);
 **/
 u32 kmalloc_ap(u32 sz, u32 *phys);
 
+/**
+   Like kmalloc_ap, but the chunk is zeroed.
+**/
+u32 kmalloc_apz(u32 sz, u32 *phys);
+
 /**
    General allocation function.
 **/
@@ -137,6 +175,11 @@ T* knew_phys(u32* phys) {
   return (T*)kmalloc_ap(sizeof(T), phys);
 }
 
+template <typename T>
+T* knew_phys_zeroed(u32* phys) {
+  return (T*)kmalloc_apz(sizeof(T), phys);
+}
+
 template <typename T>
 T* knew_array(int size) {
   int max = sizeof(T) * size;
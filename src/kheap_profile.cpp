@@ -0,0 +1,293 @@
+#include "kheap_profile.hpp"
+
+#ifdef KHEAP_PROFILE
+
+#include "kheap.hpp"
+#include "spinlock.hpp"
+#include "scope.hpp"
+#include "timer.hpp"
+#include "console.hpp"
+#include "inspector.hpp"
+#include "character.hpp"
+#include "fs/devfs.hpp"
+
+namespace kheap_profile {
+  struct Block {
+    void* ptr;
+    u32 size;
+    u32 ticks;
+    u32 site;
+  };
+
+  struct Site {
+    void* caller;
+    u32 live_bytes;
+    u32 live_count;
+    u32 allocs;
+  };
+
+  // Both tables are open addressed with linear probing; a zero key is
+  // an empty slot. They're static so that recording never allocates.
+  static Block blocks[cMaxBlocks];
+  static Site sites[cMaxSites];
+
+  static u32 block_count = 0;
+  static u32 dropped = 0;
+
+  static SpinLock lock;
+
+  static char report[cReportSize];
+
+  static inline u32 hash(u32 key, u32 size) {
+    return ((key >> 2) * 2654435761U) & (size - 1);
+  }
+
+  static u32 find_site(void* caller) {
+    u32 i = hash((u32)caller, cMaxSites);
+
+    for(u32 n = 0; n < cMaxSites; n++) {
+      if(sites[i].caller == caller) return i;
+
+      if(!sites[i].caller) {
+        sites[i].caller = caller;
+        return i;
+      }
+
+      i = (i + 1) & (cMaxSites - 1);
+    }
+
+    return cMaxSites;
+  }
+
+  void record(void* ptr, u32 size, void* caller) {
+    if(!ptr) return;
+
+    synchronized(lock) {
+      u32 site = find_site(caller);
+
+      if(site == cMaxSites || block_count == cMaxBlocks - 1) {
+        dropped++;
+        return;
+      }
+
+      u32 i = hash((u32)ptr, cMaxBlocks);
+      while(blocks[i].ptr) i = (i + 1) & (cMaxBlocks - 1);
+
+      blocks[i].ptr = ptr;
+      blocks[i].size = size;
+      blocks[i].ticks = timer.ticks;
+      blocks[i].site = site;
+      block_count++;
+
+      sites[site].live_bytes += size;
+      sites[site].live_count++;
+      sites[site].allocs++;
+    }
+  }
+
+  void forget(void* ptr) {
+    if(!ptr) return;
+
+    synchronized(lock) {
+      u32 i = hash((u32)ptr, cMaxBlocks);
+
+      while(blocks[i].ptr != ptr) {
+        // Allocated before we had room to remember it.
+        if(!blocks[i].ptr) return;
+        i = (i + 1) & (cMaxBlocks - 1);
+      }
+
+      Site& site = sites[blocks[i].site];
+      site.live_bytes -= blocks[i].size;
+      site.live_count--;
+      block_count--;
+
+      // Shift later entries of the probe run back into the gap, so
+      // lookups never stop short of them.
+      u32 j = i;
+
+      for(;;) {
+        j = (j + 1) & (cMaxBlocks - 1);
+        if(!blocks[j].ptr) break;
+
+        u32 home = hash((u32)blocks[j].ptr, cMaxBlocks);
+
+        bool movable = (i <= j) ? (home <= i || home > j)
+                                : (home <= i && home > j);
+        if(movable) {
+          blocks[i] = blocks[j];
+          i = j;
+        }
+      }
+
+      blocks[i].ptr = 0;
+    }
+  }
+
+  struct Writer {
+    char* buf;
+    u32 size;
+    u32 pos;
+
+    void put(char c) {
+      if(pos < size - 1) buf[pos++] = c;
+    }
+
+    void str(const char* s) {
+      while(*s) put(*s++);
+    }
+
+    void dec(u32 n) {
+      char tmp[12];
+      int i = 0;
+
+      do {
+        tmp[i++] = '0' + (n % 10);
+        n /= 10;
+      } while(n);
+
+      while(i > 0) put(tmp[--i]);
+    }
+
+    void hex(u32 n) {
+      str("0x");
+      for(int i = 28; i >= 0; i -= 4) {
+        put("0123456789abcdef"[(n >> i) & 0xF]);
+      }
+    }
+  };
+
+  static u32 generate() {
+    Writer w = { report, cReportSize, 0 };
+
+    u32 counts[Heap::cFirstLevels];
+    u32 bytes[Heap::cFirstLevels];
+
+    kheap->hole_stats(counts, bytes);
+
+    w.str("heap ");
+    w.hex(kheap->start_address);
+    w.str("-");
+    w.hex(kheap->end_address);
+    w.str(", ");
+    w.dec(kheap->hole_count);
+    w.str(" holes\n");
+
+    for(u32 i = 0; i < Heap::cFirstLevels; i++) {
+      if(!counts[i]) continue;
+
+      w.str("  holes >= ");
+      w.dec(1 << i);
+      w.str(": ");
+      w.dec(counts[i]);
+      w.str(" (");
+      w.dec(bytes[i]);
+      w.str(" bytes)\n");
+    }
+
+    w.str("live blocks ");
+    w.dec(block_count);
+    w.str(", untracked ");
+    w.dec(dropped);
+    w.str("\n");
+
+    // Pick the biggest sites without sorting the table in place.
+    u32 last = 0xFFFFFFFF;
+    u32 last_site = cMaxSites;
+
+    for(u32 n = 0; n < cTopSites; n++) {
+      u32 best = cMaxSites;
+
+      for(u32 i = 0; i < cMaxSites; i++) {
+        Site& s = sites[i];
+        if(!s.caller || !s.live_bytes) continue;
+
+        // Strictly after the previous pick in (bytes, index) order.
+        if(s.live_bytes > last) continue;
+        if(s.live_bytes == last && i <= last_site) continue;
+
+        if(best == cMaxSites || s.live_bytes > sites[best].live_bytes) {
+          best = i;
+        }
+      }
+
+      if(best == cMaxSites) break;
+
+      Site& s = sites[best];
+      u32 offset = 0;
+      const char* name = inspector.resolve_symbol((u32)s.caller, &offset);
+
+      w.str("  ");
+      w.hex((u32)s.caller);
+      w.str(" ");
+
+      if(name) {
+        w.str(name);
+        w.str("+");
+        w.dec(offset);
+      } else {
+        w.str("?");
+      }
+
+      w.str(": ");
+      w.dec(s.live_bytes);
+      w.str(" bytes in ");
+      w.dec(s.live_count);
+      w.str(" blocks, ");
+      w.dec(s.allocs);
+      w.str(" allocs\n");
+
+      last = s.live_bytes;
+      last_site = best;
+    }
+
+    report[w.pos] = 0;
+    return w.pos;
+  }
+
+  void dump() {
+    if(!kheap) return;
+
+    generate();
+    console.write(report);
+  }
+
+  class Device : public character::Device {
+    u32 length_;
+
+  public:
+    Device()
+      : length_(0)
+    {}
+
+    u32 read_bytes(u32 offset, u32 size, u8* buffer) {
+      // Take a fresh snapshot whenever reading starts over.
+      if(offset == 0) {
+        synchronized(lock) {
+          length_ = generate();
+        }
+      }
+
+      if(offset >= length_) return 0;
+      if(size > length_ - offset) size = length_ - offset;
+
+      memcpy(buffer, (u8*)report + offset, size);
+      return size;
+    }
+
+    u32 write_bytes(u32 offset, u32 size, u8* buffer) {
+      return 0;
+    }
+
+    int ioctl(unsigned long req, va_list args) {
+      return -1;
+    }
+  };
+
+  void init() {
+    Device* dev = new(kheap) Device;
+    devfs::main.add_char_device(dev, "kheap");
+  }
+}
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef KHEAP_PROFILE_HPP
+#define KHEAP_PROFILE_HPP
+
+#include "common.hpp"
+
+// Optional record of who owns kernel heap memory. Build with
+// -DKHEAP_PROFILE (see the Makefile) and every kmalloc is remembered
+// along with its caller, size and the tick it happened on. Live bytes
+// and counts are rolled up per call site, and the report, along with a
+// histogram of the Heap's holes, can be read from /dev/kheap or is
+// printed at panic.
+//
+// Without KHEAP_PROFILE all of this compiles away.
+namespace kheap_profile {
+  const static u32 cMaxBlocks = 8192;
+  const static u32 cMaxSites = 512;
+  const static u32 cReportSize = 16384;
+
+  // Sites shown in the report, biggest first.
+  const static u32 cTopSites = 40;
+
+#ifdef KHEAP_PROFILE
+  void init();
+  void record(void* ptr, u32 size, void* caller);
+  void forget(void* ptr);
+  void dump();
+#else
+  static inline void init() { }
+  static inline void record(void* ptr, u32 size, void* caller) { }
+  static inline void forget(void* ptr) { }
+  static inline void dump() { }
+#endif
+}
+
+#endif
@@ -0,0 +1,159 @@
+#include "kpages.hpp"
+#include "paging.hpp"
+#include "buddy.hpp"
+#include "cpu.hpp"
+#include "spinlock.hpp"
+#include "scope.hpp"
+#include "reclaim.hpp"
+#include "zero_pool.hpp"
+
+namespace kpages {
+  // Free slots, lowest address on top.
+  static u16 small_free[cSmallSlots];
+  static u32 small_top = 0;
+
+  static u16 large_free[cLargeSlots];
+  static u32 large_top = 0;
+
+  // Pages mapped in each large slot.
+  static u8 large_pages[cLargeSlots];
+
+  static u32 mapped = 0;
+  static bool ready = false;
+
+  static SpinLock lock;
+
+  void init() {
+    vmem.reserve_kernel_tables(KPAGES_START, KPAGES_END);
+
+    for(u32 i = 0; i < cSmallSlots; i++) {
+      small_free[i] = cSmallSlots - 1 - i;
+    }
+
+    for(u32 i = 0; i < cLargeSlots; i++) {
+      large_free[i] = cLargeSlots - 1 - i;
+    }
+
+    small_top = cSmallSlots;
+    large_top = cLargeSlots;
+
+    // Until now the heap has been doing this.
+    ready = true;
+  }
+
+  // Returns the slot's address, or 0 if the class is used up.
+  static u32 take_slot(bool large) {
+    synchronized(lock) {
+      if(large) {
+        if(large_top == 0) return 0;
+        return cLargeStart + large_free[--large_top] * cMaxPages * 0x1000;
+      }
+
+      if(small_top == 0) return 0;
+      return KPAGES_START + small_free[--small_top] * 0x1000;
+    }
+
+    return 0;
+  }
+
+  static void give_slot(u32 addr) {
+    synchronized(lock) {
+      if(addr < cLargeStart) {
+        small_free[small_top++] = (addr - KPAGES_START) / 0x1000;
+      } else {
+        large_free[large_top++] =
+          (addr - cLargeStart) / (cMaxPages * 0x1000);
+      }
+    }
+  }
+
+  // count frames in a row, with any zeroing already done noted.
+  static bool get_frames(u32 count, u32* frame, bool* zeroed) {
+    *zeroed = false;
+
+    if(count == 1) {
+      if(zero_pool::take(frame)) {
+        *zeroed = true;
+        return true;
+      }
+
+      return reclaim::alloc(0, frame);
+    }
+
+    u32 order = 0;
+    while((1U << order) < count) order++;
+
+    if(!reclaim::alloc(order, frame)) return false;
+
+    // The frames of a block can go back one by one.
+    for(u32 i = count; i < (1U << order); i++) frames.put(*frame + i);
+
+    return true;
+  }
+
+  void* alloc(u32 size, u32* phys, bool zero) {
+    u32 count = cpu::page_align(size) / cpu::cPageSize;
+    if(!ready || count == 0 || count > cMaxPages) return 0;
+
+    bool large = count > 1;
+
+    u32 addr = take_slot(large);
+    if(!addr) return 0;
+
+    u32 frame;
+    bool zeroed;
+
+    if(!get_frames(count, &frame, &zeroed)) {
+      give_slot(addr);
+      return 0;
+    }
+
+    for(u32 i = 0; i < count; i++) {
+      vmem.get_kernel_page(addr + i * cpu::cPageSize, false)
+        ->assign(frame + i, true, true);
+    }
+
+    synchronized(lock) {
+      if(large) {
+        large_pages[(addr - cLargeStart) / (cMaxPages * 0x1000)] = count;
+      }
+
+      mapped += count;
+    }
+
+    if(zero && !zeroed) memset((u8*)addr, 0, count * cpu::cPageSize);
+    if(phys) *phys = frame * cpu::cPageSize;
+
+    return (void*)addr;
+  }
+
+  void free(void* ptr) {
+    u32 addr = (u32)ptr;
+    ASSERT(contains_p(ptr) && (addr & ~cpu::cPageMask) == 0);
+
+    u32 count = 1;
+
+    if(addr >= cLargeStart) {
+      synchronized(lock) {
+        count = large_pages[(addr - cLargeStart) / (cMaxPages * 0x1000)];
+      }
+    }
+
+    for(u32 i = 0; i < count; i++) {
+      u32 page = addr + i * cpu::cPageSize;
+
+      vmem.free_frame(vmem.get_kernel_page(page, false));
+      cpu::invalidate_page(page);
+    }
+
+    synchronized(lock) {
+      mapped -= count;
+    }
+
+    give_slot(addr);
+  }
+
+  u32 mapped_pages() {
+    return mapped;
+  }
+}
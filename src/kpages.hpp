@@ -0,0 +1,41 @@
+#ifndef KPAGES_HPP
+#define KPAGES_HPP
+
+#include "common.hpp"
+
+// Page aligned kernel allocations, like page tables and directories,
+// get whole frames mapped into a region of their own instead of a
+// block carved out of the heap at a page boundary. Slots are fixed
+// size and kept on free stacks, so allocating and freeing never
+// search.
+#define KPAGES_START 0xD7400000
+#define KPAGES_END   0xDA400000
+
+namespace kpages {
+  // Requests up to this many pages are served here. The frames behind
+  // one are physically contiguous.
+  const static u32 cMaxPages = 4;
+
+  // One page slots, then cMaxPages page slots for the rest.
+  const static u32 cSmallSlots = 8192;
+  const static u32 cLargeSlots = 1024;
+
+  const static u32 cLargeStart =
+    KPAGES_START + cSmallSlots * 0x1000;
+
+  void init();
+
+  // Returns 0 if the request is too big, there's no slot left, or no
+  // memory. phys, if given, gets the physical address.
+  void* alloc(u32 size, u32* phys, bool zero=false);
+
+  void free(void* ptr);
+
+  static inline bool contains_p(void* ptr) {
+    return (u32)ptr >= KPAGES_START && (u32)ptr < KPAGES_END;
+  }
+
+  u32 mapped_pages();
+}
+
+#endif
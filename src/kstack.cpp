@@ -0,0 +1,112 @@
+#include "kstack.hpp"
+#include "paging.hpp"
+#include "cpu.hpp"
+#include "spinlock.hpp"
+#include "scope.hpp"
+#include "reclaim.hpp"
+
+namespace kstack {
+  // Slots holding a stack, mapped or not.
+  static u32 used[(cSlots + 31) / 32];
+
+  static u32 cache[cCacheSize];
+  static u32 cache_count = 0;
+
+  static SpinLock lock;
+
+  static inline u32 slot_base(u32 slot) {
+    return KSTACK_START + slot * cSlotSize + cpu::cPageSize;
+  }
+
+  static void unmap(u32 base) {
+    for(u32 addr = base; addr < base + KERNEL_STACK_SIZE;
+        addr += cpu::cPageSize) {
+      vmem.free_frame(vmem.get_kernel_page(addr, false));
+      cpu::invalidate_page(addr);
+    }
+  }
+
+  static void drop_slot(u32 base) {
+    u32 slot = (base - KSTACK_START) / cSlotSize;
+
+    synchronized(lock) {
+      used[slot / 32] &= ~(1 << (slot % 32));
+    }
+  }
+
+  // The cached stacks are still mapped, so they are frames we can do
+  // without.
+  static u32 shrink(u32 target) {
+    u32 released = 0;
+
+    while(released < target) {
+      u32 base;
+
+      synchronized(lock) {
+        if(cache_count == 0) return released;
+        base = cache[--cache_count];
+      }
+
+      unmap(base);
+      drop_slot(base);
+
+      released += KERNEL_STACK_SIZE / cpu::cPageSize;
+    }
+
+    return released;
+  }
+
+  static reclaim::Shrinker shrinker = {
+    "kernel-stacks", shrink, reclaim::eFrames, false, 0, 0
+  };
+
+  void init() {
+    vmem.reserve_kernel_tables(KSTACK_START, KSTACK_END);
+    reclaim::add(&shrinker);
+  }
+
+  u32 alloc() {
+    u32 slot = cSlots;
+
+    synchronized(lock) {
+      if(cache_count > 0) return cache[--cache_count];
+
+      for(u32 i = 0; i < cSlots; i++) {
+        if((used[i / 32] & (1 << (i % 32))) == 0) {
+          used[i / 32] |= (1 << (i % 32));
+          slot = i;
+          break;
+        }
+      }
+    }
+
+    if(slot == cSlots) PANIC("Out of kernel stacks");
+
+    // The guard page below stays unmapped.
+    u32 base = slot_base(slot);
+
+    for(u32 addr = base; addr < base + KERNEL_STACK_SIZE;
+        addr += cpu::cPageSize) {
+      vmem.alloc_kernel_frame(vmem.get_kernel_page(addr, false), true);
+    }
+
+    return base;
+  }
+
+  void release(u32 addr) {
+    ASSERT(contains_p(addr) && !guard_p(addr));
+
+    u32 slot = (addr - KSTACK_START) / cSlotSize;
+    u32 base = slot_base(slot);
+
+    synchronized(lock) {
+      if(cache_count < cCacheSize) {
+        cache[cache_count++] = base;
+        return;
+      }
+    }
+
+    unmap(base);
+    drop_slot(base);
+  }
+}
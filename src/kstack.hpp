@@ -0,0 +1,40 @@
+#ifndef KSTACK_HPP
+#define KSTACK_HPP
+
+#include "common.hpp"
+#include "thread.hpp"
+
+// Kernel stacks live in their own region, each with an unmapped guard
+// page below it, so running off the end faults instead of scribbling
+// over whatever the heap put next to it.
+#define KSTACK_START 0xD2400000
+#define KSTACK_END   0xD3400000
+
+namespace kstack {
+  // A stack and the guard page under it.
+  const static u32 cSlotSize = KERNEL_STACK_SIZE + 0x1000;
+  const static u32 cSlots = (KSTACK_END - KSTACK_START) / cSlotSize;
+
+  // Freed stacks kept mapped for reuse, newest first, so a new thread
+  // usually gets memory that is still in the cache.
+  const static u32 cCacheSize = 16;
+
+  void init();
+
+  // The lowest address of a fresh stack of KERNEL_STACK_SIZE bytes.
+  u32 alloc();
+
+  // Give back the stack that addr lies in.
+  void release(u32 addr);
+
+  static inline bool contains_p(u32 addr) {
+    return addr >= KSTACK_START && addr < KSTACK_START + cSlots * cSlotSize;
+  }
+
+  // Whether addr is in one of the guard pages.
+  static inline bool guard_p(u32 addr) {
+    return contains_p(addr) && (addr - KSTACK_START) % cSlotSize < 0x1000;
+  }
+}
+
+#endif
@@ -205,6 +205,8 @@ namespace sys {
       if(node == tail_) {
         tail_ = node->prev;
       }
+
+      kfree(node);
     }
 
     T& append(T elem) {
@@ -52,13 +52,14 @@
 
 
 extern void* kmalloc_vp(int size);
+extern void* krealloc_vp(void* ptr, int size);
 extern void kfree(void* ptr);
 
 #define mem_init()
 #define mem_free                    kfree
 #define mem_malloc(c)               kmalloc_vp(c)
 #define mem_calloc(c, n)            kmalloc_vp((c) * (n)))
-#define mem_realloc(p, sz)          (p)
+#define mem_realloc(p, sz)          krealloc_vp((p), (sz))
 
 #define LWIP_DEBUG                  1
 
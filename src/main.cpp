@@ -21,6 +21,11 @@
 #include "scheduler.hpp"
 #include "tar.hpp"
 #include "inspector.hpp"
+#include "kheap_profile.hpp"
+#include "reclaim.hpp"
+#include "memmap.hpp"
+#include "zram.hpp"
+#include "working_set.hpp"
 
 #include "cpu.hpp"
 #include "percpu.hpp"
@@ -66,21 +71,10 @@ extern "C" int kmain(struct multiboot *mboot_ptr, u32 magic, u32 kstart, u32 ken
   // console.clear();
   console.setup();
 
-  u32 mem_total;
-  if(mboot_ptr->flags & 1) {
-    mem_total = (mboot_ptr->mem_lower * 1024) +
-                (mboot_ptr->mem_upper * 1024);
+  memmap::init(mboot_ptr);
+  memmap::print();
 
-    if(mem_total > 1048576) {
-      console.printf("mem total: %dMB\n", mem_total / 1048576);
-    } else {
-      console.printf("mem total: %dB\n", mem_total);
-    }
-
-  } else {
-    console.printf("memory unknown, default to 16M\n");
-    mem_total = 0x1000000;
-  }
+  u32 mem_total = memmap::top();
 
   u32 kernel_size = kend - kstart;
 
@@ -139,14 +133,28 @@ extern "C" int kmain(struct multiboot *mboot_ptr, u32 magic, u32 kstart, u32 ken
 
   console.printf("Imported entries from tar: %d\n", count);
 
+  // Everything is unpacked into tmpfs, the archive can go.
+  memmap::release(initrd_location - KERNEL_VIRTUAL_BASE,
+                  initrd_end - KERNEL_VIRTUAL_BASE);
+
+  console.printf("initrd: released %dkB\n",
+                 (initrd_end - initrd_location) / 1024);
+
   // Initialise the initial ramdisk, and set it as the filesystem root.
   // fs_root = initrd::fs.init(initrd_location);
 
   block::registry.init();
   console_driver::init();
+  kheap_profile::init();
+
+  reclaim::start();
+  working_set::start();
 
   pci_bus.init();
 
+  // Compressed swap in memory, tried before any swap partition.
+  zram::init(mem_total / cpu::cPageSize);
+
   // block::registry.print();
 
   scheduler.spawn_init(run_init);
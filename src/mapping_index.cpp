@@ -0,0 +1,143 @@
+#include "mapping_index.hpp"
+#include "kheap.hpp"
+
+// Index of the first mapping that starts above addr.
+u32 MappingIndex::upper_bound(u32 addr) {
+  u32 lo = 0;
+  u32 hi = count_;
+
+  while(lo < hi) {
+    u32 mid = (lo + hi) / 2;
+
+    if(entries_[mid]->page_start() <= addr) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return lo;
+}
+
+void MappingIndex::grow() {
+  u32 capacity = capacity_ ? capacity_ * 2 : cInitialCapacity;
+
+  MemoryMapping** entries =
+    (MemoryMapping**)kmalloc(capacity * sizeof(MemoryMapping*));
+
+  if(entries_) {
+    memcpy((u8*)entries, (u8*)entries_, count_ * sizeof(MemoryMapping*));
+    kfree(entries_);
+  }
+
+  entries_ = entries;
+  capacity_ = capacity;
+}
+
+MemoryMapping* MappingIndex::insert(MemoryMapping& mapping) {
+  if(count_ == capacity_) grow();
+
+  MemoryMapping* m = new(kheap) MemoryMapping(mapping);
+
+  u32 pos = upper_bound(m->page_start());
+
+  for(u32 i = count_; i > pos; i--) {
+    entries_[i] = entries_[i - 1];
+  }
+
+  entries_[pos] = m;
+  count_++;
+
+  return m;
+}
+
+// Index of mapping itself, which must be in the index.
+u32 MappingIndex::position(MemoryMapping* mapping) {
+  u32 pos = upper_bound(mapping->page_start());
+
+  // Mappings that start on the same page sit just below pos.
+  while(pos > 0 && entries_[pos - 1] != mapping) pos--;
+  ASSERT(pos > 0);
+
+  return pos - 1;
+}
+
+void MappingIndex::remove(MemoryMapping* mapping) {
+  u32 pos = position(mapping);
+
+  for(u32 i = pos + 1; i < count_; i++) {
+    entries_[i - 1] = entries_[i];
+  }
+
+  count_--;
+
+  if(last_ == mapping) last_ = 0;
+  kfree(mapping);
+}
+
+MemoryMapping* MappingIndex::split(MemoryMapping* mapping, u32 addr) {
+  ASSERT((addr & ~cpu::cPageMask) == 0);
+  ASSERT(addr > mapping->page_start() && addr < mapping->page_end());
+
+  MemoryMapping upper = mapping->split(addr);
+  return insert(upper);
+}
+
+MemoryMapping* MappingIndex::find(u32 addr) {
+  if(last_ && last_->contains_p(addr)) return last_;
+
+  u32 pos = upper_bound(addr);
+  if(pos == 0) return 0;
+
+  // Neighbouring mappings can share a page when one ends and the next
+  // begins part way through it, the earlier one wins.
+  if(pos > 1 && entries_[pos - 2]->contains_p(addr)) {
+    last_ = entries_[pos - 2];
+    return last_;
+  }
+
+  if(entries_[pos - 1]->contains_p(addr)) {
+    last_ = entries_[pos - 1];
+    return last_;
+  }
+
+  return 0;
+}
+
+MemoryMapping* MappingIndex::prev(MemoryMapping* mapping) {
+  u32 pos = position(mapping);
+  return pos > 0 ? entries_[pos - 1] : 0;
+}
+
+MemoryMapping* MappingIndex::next(MemoryMapping* mapping) {
+  u32 pos = position(mapping);
+  return pos + 1 < count_ ? entries_[pos + 1] : 0;
+}
+
+MemoryMapping* MappingIndex::find_overlap(u32 start, u32 end) {
+  u32 pos = upper_bound(start);
+  if(pos > 0) pos--;
+  if(pos > 0) pos--;
+
+  for(; pos < count_; pos++) {
+    MemoryMapping* m = entries_[pos];
+
+    if(m->page_start() >= end) break;
+    if(m->page_end() > start) return m;
+  }
+
+  return 0;
+}
+
+void MappingIndex::clear() {
+  for(u32 i = 0; i < count_; i++) {
+    kfree(entries_[i]);
+  }
+
+  if(entries_) kfree(entries_);
+
+  entries_ = 0;
+  count_ = 0;
+  capacity_ = 0;
+  last_ = 0;
+}
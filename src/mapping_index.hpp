@@ -0,0 +1,66 @@
+#ifndef MAPPING_INDEX_HPP
+#define MAPPING_INDEX_HPP
+
+#include "common.hpp"
+#include "paging.hpp"
+
+// The memory mappings of a process, kept sorted by start address so
+// that the one covering a faulting address is found with a binary
+// search. The mapping found last is remembered, since faults tend to
+// come in runs against the same mapping.
+//
+// Mappings are allocated individually, so pointers to them stay good
+// until they are removed.
+class MappingIndex {
+  MemoryMapping** entries_;
+  u32 count_;
+  u32 capacity_;
+
+  MemoryMapping* last_;
+
+  const static u32 cInitialCapacity = 8;
+
+  u32 upper_bound(u32 addr);
+  u32 position(MemoryMapping* mapping);
+  void grow();
+
+public:
+  MappingIndex()
+    : entries_(0)
+    , count_(0)
+    , capacity_(0)
+    , last_(0)
+  {}
+
+  u32 count() {
+    return count_;
+  }
+
+  MemoryMapping* at(u32 i) {
+    return entries_[i];
+  }
+
+  MemoryMapping* insert(MemoryMapping& mapping);
+  void remove(MemoryMapping* mapping);
+
+  // Split mapping at the page aligned addr, returning the new mapping
+  // that covers [addr, end).
+  MemoryMapping* split(MemoryMapping* mapping, u32 addr);
+
+  MemoryMapping* find(u32 addr);
+
+  // The neighbours of mapping in address order, or 0.
+  MemoryMapping* prev(MemoryMapping* mapping);
+  MemoryMapping* next(MemoryMapping* mapping);
+
+  // The lowest mapping with any page in [start, end), or 0.
+  MemoryMapping* find_overlap(u32 start, u32 end);
+
+  bool overlap_p(u32 start, u32 end) {
+    return find_overlap(start, end) != 0;
+  }
+
+  void clear();
+};
+
+#endif
@@ -0,0 +1,129 @@
+#include "memmap.hpp"
+#include "paging.hpp"
+#include "buddy.hpp"
+#include "console.hpp"
+#include "cpu.hpp"
+
+namespace memmap {
+  struct Entry {
+    u32 size;   // Of the rest of the entry, not counting this field.
+    u64 addr;
+    u64 len;
+    u32 type;
+  } __attribute__((packed));
+
+  static Range ranges[cMaxRanges];
+  static u32 nranges = 0;
+
+  // Without PAE anything past here can't be mapped.
+  const static u32 cLimit = 0xFFFFF000;
+
+  static void add(u64 start, u64 end) {
+    if(start >= cLimit) return;
+    if(end > cLimit) end = cLimit;
+    if(end <= start) return;
+
+    if(nranges == cMaxRanges) {
+      console.printf("memmap: too many ranges, ignoring %x-%x\n",
+                     (u32)start, (u32)end);
+      return;
+    }
+
+    // Kept sorted by start address.
+    u32 pos = nranges++;
+    while(pos > 0 && ranges[pos - 1].start > start) {
+      ranges[pos] = ranges[pos - 1];
+      pos--;
+    }
+
+    ranges[pos].start = (u32)start;
+    ranges[pos].end = (u32)end;
+  }
+
+  // Take [start, end) out of the available ranges. Boot loaders are
+  // allowed to report overlapping entries, reserved ones win.
+  static void remove(u64 start, u64 end) {
+    if(start >= cLimit) return;
+    if(end > cLimit) end = cLimit;
+
+    for(u32 i = 0; i < nranges; i++) {
+      Range r = ranges[i];
+      if(end <= r.start || start >= r.end) continue;
+
+      // Drop it, then put back whatever sticks out on either side.
+      for(u32 j = i + 1; j < nranges; j++) ranges[j - 1] = ranges[j];
+      nranges--;
+
+      if(r.start < start) add(r.start, start);
+      if(r.end > end) add(end, r.end);
+
+      // The array was reshuffled, start over.
+      i = (u32)-1;
+    }
+  }
+
+  void init(multiboot* mboot) {
+    nranges = 0;
+
+    if(mboot->flags & MULTIBOOT_FLAG_MMAP) {
+      u32 pos = mboot->mmap_addr + KERNEL_VIRTUAL_BASE;
+      u32 fin = pos + mboot->mmap_length;
+
+      for(Entry* e = (Entry*)pos; pos < fin; e = (Entry*)pos) {
+        if(e->type == eAvailable) add(e->addr, e->addr + e->len);
+        pos += e->size + sizeof(e->size);
+      }
+
+      pos = mboot->mmap_addr + KERNEL_VIRTUAL_BASE;
+
+      for(Entry* e = (Entry*)pos; pos < fin; e = (Entry*)pos) {
+        if(e->type != eAvailable) remove(e->addr, e->addr + e->len);
+        pos += e->size + sizeof(e->size);
+      }
+    } else if(mboot->flags & MULTIBOOT_FLAG_MEM) {
+      add(0, mboot->mem_lower * 1024);
+      add(0x100000, 0x100000 + (u64)mboot->mem_upper * 1024);
+    } else {
+      console.printf("memory unknown, default to 16M\n");
+      add(0x100000, 0x1000000);
+    }
+  }
+
+  u32 top() {
+    return nranges ? ranges[nranges - 1].end & cpu::cPageMask : 0;
+  }
+
+  u32 count() {
+    return nranges;
+  }
+
+  Range& range(u32 i) {
+    return ranges[i];
+  }
+
+  void release(u32 start, u32 end) {
+    for(u32 i = 0; i < nranges; i++) {
+      u32 s = start > ranges[i].start ? start : ranges[i].start;
+      u32 e = end < ranges[i].end ? end : ranges[i].end;
+
+      s = cpu::page_align(s) / cpu::cPageSize;
+      e = (e & cpu::cPageMask) / cpu::cPageSize;
+
+      // Frame 0 means "no frame" in a page table entry.
+      if(s == 0) s = 1;
+
+      if(s < e) frames.add_range(s, e);
+    }
+  }
+
+  void print() {
+    u32 total = 0;
+
+    for(u32 i = 0; i < nranges; i++) {
+      console.printf("memory: %x-%x\n", ranges[i].start, ranges[i].end - 1);
+      total += ranges[i].end - ranges[i].start;
+    }
+
+    console.printf("mem total: %dMB\n", total / 1048576);
+  }
+}
@@ -0,0 +1,46 @@
+#ifndef MEMMAP_HPP
+#define MEMMAP_HPP
+
+#include "common.hpp"
+#include "multiboot.hpp"
+
+// The physical memory the boot loader told us about. Only ranges it
+// marks available are ever handed to the frame allocator; the BIOS
+// area, ACPI tables and other reserved ranges stay out of it.
+namespace memmap {
+  const static u32 cMaxRanges = 32;
+
+  // Multiboot memory map entry types.
+  enum Types {
+    eAvailable = 1,
+    eReserved = 2,
+    eACPIReclaimable = 3,
+    eACPINVS = 4,
+    eBadRAM = 5
+  };
+
+  // Physical byte addresses, [start, end).
+  struct Range {
+    u32 start;
+    u32 end;
+  };
+
+  // Read the memory map, or fall back to mem_lower and mem_upper when
+  // the boot loader didn't give one. Must run while low memory is
+  // still mapped.
+  void init(multiboot* mboot);
+
+  // Just past the highest available byte.
+  u32 top();
+
+  u32 count();
+  Range& range(u32 i);
+
+  // Hand the available frames in [start, end) to the frame allocator.
+  // Partial pages at either end are left out.
+  void release(u32 start, u32 end);
+
+  void print();
+}
+
+#endif
@@ -0,0 +1,186 @@
+#include "page_cache.hpp"
+#include "hash_table.hpp"
+#include "pair.hpp"
+#include "buddy.hpp"
+#include "spinlock.hpp"
+#include "scope.hpp"
+#include "reclaim.hpp"
+#include "cpu.hpp"
+
+namespace page_cache {
+  typedef sys::OOHash<sys::Pair<u32,u32>, u32> Frames;
+
+  static Frames* cache = 0;
+  static SpinLock lock;
+
+  static u32 cached_pages = 0;
+  static u32 cache_hits = 0;
+
+  // Drop the pages no process has mapped any more, the cache holding
+  // the only reference.
+  static u32 shrink(u32 target) {
+    u32 nodes[reclaim::cBatch];
+    u32 offsets[reclaim::cBatch];
+    u32 victims[reclaim::cBatch];
+    u32 found = 0;
+
+    if(target > reclaim::cBatch) target = reclaim::cBatch;
+
+    synchronized(lock) {
+      Frames::Iterator i = cache->iterator();
+
+      while(found < target) {
+        auto entry = i.next();
+        if(!entry) break;
+
+        if(frames.count(entry->value) == 1) {
+          nodes[found] = entry->key.one;
+          offsets[found] = entry->key.two;
+          victims[found] = entry->value;
+          found++;
+        }
+      }
+
+      for(u32 j = 0; j < found; j++) {
+        cache->remove(sys::pair(nodes[j], offsets[j]));
+      }
+
+      cached_pages -= found;
+    }
+
+    for(u32 j = 0; j < found; j++) {
+      frames.put(victims[j]);
+    }
+
+    return found;
+  }
+
+  static reclaim::Shrinker shrinker = {
+    "page-cache", shrink, reclaim::eFrames, true, 0, 0
+  };
+
+  void init() {
+    cache = new(kheap) Frames;
+    reclaim::add(&shrinker);
+  }
+
+  bool map(fs::Node* node, u32 offset, x86::Page* page) {
+    if(!cache) return false;
+
+    u32 frame;
+
+    synchronized(lock) {
+      if(!cache->fetch(sys::pair((u32)node, offset), &frame)) return false;
+
+      frames.get(frame);
+      cache_hits++;
+    }
+
+    page->assign(frame, false, false);
+    return true;
+  }
+
+  bool contains_p(fs::Node* node, u32 offset) {
+    if(!cache) return false;
+
+    u32 frame;
+
+    synchronized(lock) {
+      return cache->fetch(sys::pair((u32)node, offset), &frame);
+    }
+
+    return false;
+  }
+
+  void store(fs::Node* node, u32 offset, u32 frame) {
+    if(!cache || (offset & ~cpu::cPageMask)) return;
+
+    auto key = sys::pair((u32)node, offset);
+
+    synchronized(lock) {
+      u32 existing;
+
+      // Someone else faulted the same page in meanwhile, theirs stays.
+      if(cache->fetch(key, &existing)) return;
+
+      frames.get(frame);
+      cache->store(key, frame);
+      cached_pages++;
+    }
+  }
+
+  void invalidate(fs::Node* node, u32 offset, u32 len) {
+    if(!cache || len == 0) return;
+
+    u32 end = offset + len;
+    if(end < offset) end = ~0U;
+
+    // Pages are only cached at page aligned offsets, so look each one
+    // in the range up rather than scanning for the node.
+    for(u32 o = offset & cpu::cPageMask; o < end; o += cpu::cPageSize) {
+      auto key = sys::pair((u32)node, o);
+      u32 frame = 0;
+      bool found = false;
+
+      synchronized(lock) {
+        found = cache->fetch(key, &frame);
+
+        if(found) {
+          cache->remove(key);
+          cached_pages--;
+        }
+      }
+
+      if(found) frames.put(frame);
+
+      if(o + cpu::cPageSize < o) break;
+    }
+  }
+
+  void drop(fs::Node* node) {
+    if(!cache) return;
+
+    u32 offsets[reclaim::cBatch];
+    u32 victims[reclaim::cBatch];
+    u32 found;
+
+    // Removing entries upsets the iterator, so they're taken out a
+    // batch at a time.
+    do {
+      found = 0;
+
+      synchronized(lock) {
+        Frames::Iterator i = cache->iterator();
+
+        while(found < reclaim::cBatch) {
+          auto entry = i.next();
+          if(!entry) break;
+
+          if(entry->key.one == (u32)node) {
+            offsets[found] = entry->key.two;
+            victims[found] = entry->value;
+            found++;
+          }
+        }
+
+        for(u32 j = 0; j < found; j++) {
+          cache->remove(sys::pair((u32)node, offsets[j]));
+        }
+
+        cached_pages -= found;
+      }
+
+      for(u32 j = 0; j < found; j++) {
+        frames.put(victims[j]);
+      }
+    } while(found == reclaim::cBatch);
+  }
+
+  u32 pages() {
+    return cached_pages;
+  }
+
+  u32 hits() {
+    return cache_hits;
+  }
+}
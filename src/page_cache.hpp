@@ -0,0 +1,43 @@
+#ifndef PAGE_CACHE_HPP
+#define PAGE_CACHE_HPP
+
+#include "common.hpp"
+#include "fs.hpp"
+#include "paging.hpp"
+
+// Frames holding read-only file data that has been faulted into some
+// process, keyed by node and file offset. Later faults on the same
+// page of the same file map the cached frame instead of reading it
+// again, so every process running a binary shares one copy of its
+// text.
+//
+// The cache holds its own reference on each frame, and lets go of the
+// ones nobody else maps when memory runs low. The node pointer is the
+// key, so anything that changes a file's data or frees a node must
+// invalidate what's cached for it. Processes that already map a
+// dropped frame keep their copy, later faults read the file again.
+namespace page_cache {
+  void init();
+
+  // Map the cached frame for node at offset into page, read-only.
+  // Returns false if the page isn't cached.
+  bool map(fs::Node* node, u32 offset, x86::Page* page);
+
+  bool contains_p(fs::Node* node, u32 offset);
+
+  // Remember the frame backing node at offset. offset must cover a
+  // whole page of file data, and only page aligned ones are kept.
+  void store(fs::Node* node, u32 offset, u32 frame);
+
+  // Forget the cached pages of node that overlap [offset, offset + len).
+  // Costs a lookup per page of the range.
+  void invalidate(fs::Node* node, u32 offset, u32 len);
+
+  // Forget all of node, before it's freed. Walks the whole cache.
+  void drop(fs::Node* node);
+
+  u32 pages();
+  u32 hits();
+}
+
+#endif
@@ -9,44 +9,89 @@
 #include "scheduler.hpp"
 #include "process.hpp"
 #include "algo.hpp"
-
-VirtualMemory vmem = {0, 0, 0, 0};
+#include "slab.hpp"
+#include "buddy.hpp"
+#include "scope.hpp"
+#include "page_cache.hpp"
+#include "stats.hpp"
+#include "zero_pool.hpp"
+#include "reclaim.hpp"
+#include "kstack.hpp"
+#include "memmap.hpp"
+#include "vmalloc.hpp"
+#include "kpages.hpp"
+#include "swap.hpp"
+#include "descriptor_tables.hpp"
+
+VirtualMemory vmem = {0, 0, 0};
+
+// Which slots of the KMAP window are in use, one bit per slot.
+static u32 scratch_used[KMAP_SLOTS / 32];
+static SpinLock scratch_lock;
 
 using namespace algo;
 
 // Function to allocate a frame.
 void VirtualMemory::alloc_frame(x86::Page* page, bool is_kernel, bool is_writeable) {
   if(page->frame != 0) return;
-  bool ok = false;
-
-  u32 idx = first_frame(ok);
-  if(!ok) kabort();
 
-  set_frame(idx * cpu::cPageSize);
+  u32 idx;
+  if(!reclaim::alloc(0, &idx)) kabort();
 
   page->assign(idx, is_writeable, is_kernel);
 }
 
 // Function to deallocate a frame.
 void VirtualMemory::free_frame(x86::Page* page) {
+  // Only a slot on the swap device is left of it.
+  if(page->swapped) {
+    swap::release(page->frame);
+    page->clear();
+    return;
+  }
+
   u32 frame = page->frame;
 
   if(!frame) return;
-  clear_frame(frame);
+  if(page->ahead && page->accessed) stats.fault_around_used.inc();
+
+  // The zero frame is never given back, so it isn't counted either.
+  if(frame != zero_frame) frames.put(frame);
   page->clear();
 }
 
-bool MemoryMapping::fulfill(Thread* task, u32 request) {
+// Tunable: pages mapped per fault on a file-backed mapping, including
+// the one that faulted.
+u32 MemoryMapping::fault_around = 16;
+
+bool MemoryMapping::fulfill(Thread* task, u32 request, bool write) {
   u32 page_address = request & cpu::cPageMask;
 
+  if(write && large_p(page_address) && fulfill_large(page_address)) {
+    return true;
+  }
+
+  // Pages with no file data in them read as zeros until written, so
+  // they all share the zero frame until then.
+  if(!write && zero_p(page_address)) {
+    x86::Page* p = vmem.get_current_page(page_address, true);
+    if(p->present) return false;
+
+    p->assign(vmem.zero_frame, false, false);
+    if(writable_p()) p->cow = 1;
+
+    return true;
+  }
+
   // The requested start of the region is actually in the middle
   // of a page (always the first page, by the by).
   //
   // Thusly, handle this seperately.
   if(page_address < address_) {
 
-    // Firstly, allocate the page.
-    vmem.allocate_user(page_address, writable_p());
+    // Firstly, allocate the page. It's writable while we fill it,
+    // since CR0.WP makes read-only pages fault for the kernel too.
+    vmem.allocate_user(page_address, true);
 
     // zero out the unused bits at the bottom of the page
     memset((u8*)page_address, 0, address_ - page_address);
@@ -70,41 +115,218 @@ bool MemoryMapping::fulfill(Thread* task, u32 request) {
     if(read_size < target_size) {
       memset((u8*)address_ + read_size, 0, target_size - read_size);
     }
-  } else {
-    u32 request_offset = page_address - address_;
-    u32 target_offset = offset_ + request_offset;
 
-    u32 target_size;
-    if(request_offset > file_size_) {
-      target_size = 0;
-    } else {
-      target_size = file_size_ - request_offset;
-      // We only fill one page, so clamp the target_size
-      if(target_size > cpu::cPageSize) {
-        target_size = cpu::cPageSize;
-      }
+    if(!writable_p()) {
+      vmem.get_current_page(page_address, false)->rw = 0;
+      cpu::invalidate_page(page_address);
     }
 
-    u32 zero_fill_size = cpu::cPageSize - target_size;
+    return true;
+  }
+
+  // Map the faulting page along with as many of the following file
+  // pages as the fault-around window allows. Runs of pages that
+  // aren't mapped yet are filled with one read each.
+  u32 end = around_end(page_address);
+  u32 addr = page_address;
 
-    vmem.allocate_user(page_address, writable_p());
+  while(addr < end) {
+    x86::Page* p = vmem.get_current_page(addr, true);
 
-    // console.printf("on-demand mapped %x to %x for %x (offset=%d, size=%d)\n",
-        // page_address, p->frame, request,
-        // target_offset, target_size);
+    if(p->used_p()) {
+      // Faulting on a page that's already there isn't ours to fix.
+      if(addr == page_address) return false;
 
-    if(target_size > 0) {
-      node_->read(target_offset, target_size, (u8*)page_address);
+      addr += cpu::cPageSize;
+      continue;
     }
 
-    if(zero_fill_size > 0) {
-      memset((u8*)page_address + target_size, 0, zero_fill_size);
+    if(shareable_p(addr) && page_cache::map(node_, file_offset(addr), p)) {
+      if(addr != page_address) mark_ahead(p, addr);
+      addr += cpu::cPageSize;
+      continue;
     }
+
+    u32 run = addr + cpu::cPageSize;
+
+    while(run < end) {
+      x86::Page* q = vmem.get_current_page(run, true);
+      if(q->used_p()) break;
+      if(shareable_p(run) && page_cache::contains_p(node_, file_offset(run))) break;
+      run += cpu::cPageSize;
+    }
+
+    fill(addr, run, page_address);
+    addr = run;
   }
 
   return true;
 }
 
+// Whether the 4M page around page can be mapped in one go. That takes
+// a big anonymous mapping that covers all of it.
+bool MemoryMapping::large_p(u32 page) {
+  if((flags_ & eLargePages) == 0 || node_ || !writable_p()) return false;
+  if(mem_size_ < cLargeThreshold) return false;
+
+  u32 chunk = page & x86::cLargePageMask;
+  return chunk >= page_start_ && chunk + x86::cLargePageSize <= page_end_;
+}
+
+bool MemoryMapping::fulfill_large(u32 page) {
+  return vmem.map_large(page & x86::cLargePageMask, true);
+}
+
+// How far past page a fault may map. Only pages holding file data
+// are mapped ahead, and never past the page table page lives in.
+u32 MemoryMapping::around_end(u32 page) {
+  u32 end = page + cpu::cPageSize;
+
+  if(!node_ || fault_around <= 1) return end;
+
+  u32 limit = page + fault_around * cpu::cPageSize;
+  u32 table_end = (page & ~(cTableSpan - 1)) + cTableSpan;
+  u32 file_end = align(address_ + file_size_, cpu::cPageSize);
+
+  limit = min(limit, table_end);
+  limit = min(limit, page_end_);
+  limit = min(limit, file_end);
+
+  return limit > end ? limit : end;
+}
+
+void MemoryMapping::populate(u32 start, u32 end) {
+  bool write = writable_p();
+  u32 addr = start;
+
+  while(addr < end) {
+    u32 table_end = (addr & ~(cTableSpan - 1)) + cTableSpan;
+
+    if(write && large_p(addr) && fulfill_large(addr)) {
+      addr = table_end;
+      continue;
+    }
+
+    x86::Page* p = vmem.get_current_page(addr, true);
+
+    // Part of a 4M page, all of which is there already.
+    if(!p) {
+      addr = table_end;
+      continue;
+    }
+
+    if(p->swapped) swap::fault(addr);
+
+    if(p->used_p()) {
+      if(write && p->cow) vmem.break_cow(addr);
+
+      addr += cpu::cPageSize;
+      continue;
+    }
+
+    if(!node_ || addr < address_ || zero_p(addr)) {
+      fulfill(scheduler.current(), addr, write);
+
+      addr += cpu::cPageSize;
+      continue;
+    }
+
+    if(shareable_p(addr) && page_cache::map(node_, file_offset(addr), p)) {
+      addr += cpu::cPageSize;
+      continue;
+    }
+
+    // File data is read a table at a time, rather than fault_around
+    // pages at a time.
+    u32 limit = min(end, table_end);
+    limit = min(limit, (u32)align(address_ + file_size_, cpu::cPageSize));
+
+    u32 run = addr + cpu::cPageSize;
+
+    while(run < limit) {
+      x86::Page* q = vmem.get_current_page(run, true);
+      if(q->used_p()) break;
+      if(shareable_p(run) && page_cache::contains_p(node_, file_offset(run))) break;
+      run += cpu::cPageSize;
+    }
+
+    fill(addr, run, addr, false);
+    addr = run;
+  }
+}
+
+// Allocate the pages [start, end), which must all lie at or after
+// address_, and fill them from the node in one read. Unless around is
+// clear, the pages other than fault are counted as fault-around.
+void MemoryMapping::fill(u32 start, u32 end, u32 fault, bool around) {
+  u32 size = end - start;
+  u32 request_offset = start - address_;
+
+  u32 target_size = 0;
+  if(request_offset < file_size_) {
+    target_size = min(file_size_ - request_offset, size);
+  }
+
+  // Pages past the file data only need zeros, so they're taken from
+  // the pool of cleared frames while it lasts: [zero_start, zero_end).
+  u32 data_end = start + target_size;
+  u32 zero_start = align(data_end, cpu::cPageSize);
+  u32 zero_end = zero_start;
+
+  for(u32 addr = start; addr < end; addr += cpu::cPageSize) {
+    x86::Page* p = vmem.get_current_page(addr, true);
+
+    u32 frame;
+    if(addr == zero_end && zero_pool::take(&frame)) {
+      p->assign(frame, true, false);
+      zero_end += cpu::cPageSize;
+      continue;
+    }
+
+    // Writable while we fill it, since CR0.WP makes read-only pages
+    // fault for the kernel too.
+    vmem.alloc_user_frame(p, true);
+  }
+
+  // console.printf("on-demand mapped %x-%x for %x (offset=%d, size=%d)\n",
+      // start, end, fault, offset_ + request_offset, target_size);
+
+  if(target_size > 0) {
+    node_->read(offset_ + request_offset, target_size, (u8*)start);
+  }
+
+  if(data_end < zero_start) {
+    memset((u8*)data_end, 0, zero_start - data_end);
+  }
+
+  if(zero_end < end) {
+    memset((u8*)zero_end, 0, end - zero_end);
+  }
+
+  for(u32 addr = start; addr < end; addr += cpu::cPageSize) {
+    x86::Page* p = vmem.get_current_page(addr, false);
+
+    // Whole pages of read-only file data are the same for everyone
+    // mapping this node, so share them.
+    if(shareable_p(addr)) page_cache::store(node_, file_offset(addr), p->frame);
+
+    if(!writable_p()) p->rw = 0;
+    if(around && addr != fault) mark_ahead(p, addr);
+
+    cpu::invalidate_page(addr);
+  }
+}
+
+// Tag a page mapped by fault-around so we can tell later whether it
+// was ever touched.
+void MemoryMapping::mark_ahead(x86::Page* p, u32 addr) {
+  p->ahead = 1;
+  p->accessed = 0;
+  cpu::invalidate_page(addr);
+
+  stats.fault_around_mapped.inc();
+}
+
 class PageFault : public interrupt::Handler {
 public:
   void handle(Registers* regs) {
@@ -122,6 +344,39 @@ public:
     bool us = code.user_p();                  // Processor was in user-mode?
     bool reserved = code.reserved_p();        // Overwritten CPU-reserved bits of page entry?
 
+    // A page of this address space that was written out to swap.
+    if(!present && faulting_address < KERNEL_VIRTUAL_BASE &&
+       (!mmap || !mmap->inaccessible_p()) && swap::fault(faulting_address)) {
+      return;
+    }
+
+    // A write to a page shared with another address space since fork.
+    // The kernel hits these too when writing into user buffers.
+    // Pages of a mapping that was made read-only may still be marked
+    // copy-on-write, those writes are errors.
+    if(present && rw && faulting_address < KERNEL_VIRTUAL_BASE &&
+       (!mmap || mmap->writable_p())) {
+      if(vmem.break_cow(faulting_address)) return;
+    }
+
+    // Never quietly back a guard page, that's what it's there for.
+    // Overflowing the stack we're on doesn't get here, the CPU can't
+    // push this fault and double faults instead, see
+    // descriptor_tables.cpp. This catches other accesses to it.
+    if(kstack::guard_p(faulting_address)) {
+      console.printf("Kernel stack overflow at %p (eip %p)\n",
+                     faulting_address, regs->eip);
+      PANIC("Kernel stack overflow");
+    }
+
+    // Live vmalloc areas are always mapped, so anything else in there
+    // is a guard page or an area that was already freed.
+    if(vmalloc::contains_p((void*)faulting_address)) {
+      console.printf("Bad vmalloc access at %p (eip %p)\n",
+                     faulting_address, regs->eip);
+      PANIC("Bad vmalloc access");
+    }
+
     // If it's a page that the kernel is requesting above the kernel
     // start, then go ahead and allocate a frame.
     //
@@ -134,9 +389,9 @@ public:
     }
 
     // Ok, this is for a mapping in the current process.
-    if(mmap) {
+    if(mmap && !mmap->inaccessible_p()) {
       if(!rw || mmap->writable_p()) {
-        if(mmap->fulfill(scheduler.current(), faulting_address)) return;
+        if(mmap->fulfill(scheduler.current(), faulting_address, rw)) return;
       }
     }
 
@@ -183,45 +438,55 @@ void VirtualMemory::init(u32 total_memory, u32 kstart, u32 kend, u32 mem_end) {
   kernel_directory = 0;
   current_directory = 0;
 
-  u32 allocp = mem_end;
-
-  // The size of physical memory. For the moment we 
-  // assume it is 16MB big.
-  u32 mem_end_page = total_memory;
+  u32 allocp = cpu::page_align(mem_end);
 
-  nframes = mem_end_page / cpu::cPageSize;
-  frames = (u32*)bump(&allocp, INDEX_FROM_BIT(nframes));
-  memset((u8int*)frames, 0, INDEX_FROM_BIT(nframes));
+  u32 nframes = total_memory / cpu::cPageSize;
+  u32 meta_size = cpu::page_align(BuddyAllocator::meta_size(nframes));
 
   // Let's make a page directory.
-  allocp = cpu::page_align(allocp);
-
   kernel_directory = (x86::PageDirectory*)bump(&allocp, sizeof(x86::PageDirectory));
   memset((u8int*)kernel_directory, 0, sizeof(x86::PageDirectory));
   kernel_directory->physicalAddr = (u32)kernel_directory->tablesPhysical - KERNEL_VIRTUAL_BASE;
 
+  allocp = cpu::page_align(allocp);
+
   // Ok, first off, boot.s loaded a simple page directory that mapped
-  // the first 4M physical address up to KERNEL_VIRTUAL_BASE;
+  // the first 4M physical address up to KERNEL_VIRTUAL_BASE, so
+  // anything we touch before switching directories must live there.
   //
-  // So lets go ahead and keep that and add that to the map first.
-  //
-  // the memory is already in use (it holds the kernel, thats how we got here)
-  // and is loaded in from frame 0 up.
-  //
-  // Therefore alloc_user_frame MUST allocation linearly from 0 upward
-  // otherwise our page table won't point to the existing locations.
-  u32 page = 0;
-
-  u32 initial_heap_end = mem_end + KHEAP_INITIAL_SIZE;
+  // Everything up to the end of the initial heap is mapped linearly.
+  // Whole 4M chunks of that go straight into the directory as large
+  // pages, so only the tail needs a page table, which goes first. The
+  // frame metadata comes after it and is only touched once the new
+  // directory is loaded.
+  u32 tablep = allocp;
+  allocp += sizeof(x86::PageTable);
+
+  void* meta = (void*)bump(&allocp, meta_size);
+
+  u32 initial_heap_end = allocp + KHEAP_INITIAL_SIZE;
+  u32 large_end = initial_heap_end & x86::cLargePageMask;
+
+  // The memory up to here is already in use (it holds the kernel, thats
+  // how we got here), so map it straight through to the same frames.
+  for(u32 addr = KERNEL_VIRTUAL_BASE;
+      addr < large_end;
+      addr += x86::cLargePageSize)
+  {
+    // PRESENT, RW, supervisor only, global.
+    kernel_directory->tablesPhysical[addr / x86::cLargePageSize] =
+      (addr - KERNEL_VIRTUAL_BASE) | x86::cLargePage | x86::cGlobalPage | 0x3;
+  }
 
-  for(page = KERNEL_VIRTUAL_BASE;
+  for(u32 page = large_end;
       page < initial_heap_end;
       page += cpu::cPageSize)
   {
-    alloc_user_frame(get_page(&allocp, page, true, kernel_directory));
+    x86::Page* p = get_page(&tablep, page, true, kernel_directory);
+    p->assign((page - KERNEL_VIRTUAL_BASE) / cpu::cPageSize, true, true);
   }
 
-  ASSERT(allocp < initial_heap_end);
+  ASSERT(tablep <= allocp - meta_size);
 
   static PageFault page_fault;
 
@@ -230,12 +495,35 @@ void VirtualMemory::init(u32 total_memory, u32 kstart, u32 kend, u32 mem_end) {
 
   // Now, enable paging!
   switch_page_directory(kernel_directory);
+  set_double_fault_directory(kernel_directory->physicalAddr);
+  cpu::enable_global_pages();
+
+  // Whatever the boot loader reported available past the linear
+  // mapping is free for the taking.
+  frames.init(meta, nframes);
+  memmap::release(initial_heap_end - KERNEL_VIRTUAL_BASE, total_memory);
 
   // Initialise the kernel heap.
   kheap = Heap::create(allocp,
                        cpu::page_align(initial_heap_end),
                        0xCFFFF000, 0, 0);
 
+  slab::init();
+  page_cache::init();
+  zero_pool::init();
+  kstack::init();
+  vmalloc::init();
+  kpages::init();
+
+  reserve_kernel_tables(KMAP_START, KMAP_START + KMAP_SLOTS * cpu::cPageSize);
+
+  // The frame every untouched anonymous page reads from.
+  if(!frames.alloc(0, &zero_frame)) kabort();
+
+  void* zero = map_scratch(zero_frame);
+  memset((u8*)zero, 0, cpu::cPageSize);
+  unmap_scratch(zero);
+
   current_directory = clone_directory(kernel_directory);
   switch_page_directory(current_directory);
 }
@@ -257,6 +545,8 @@ x86::Page* VirtualMemory::get_page(u32* allocp, u32 address, bool make,
 
   if(dir->tables[table_idx]) { // If this table is already assigned
     return &dir->tables[table_idx]->pages[address%1024];
+  } else if(x86::large_p(dir->tablesPhysical[table_idx])) {
+    return 0;
   } else if(make) {
     *allocp = cpu::page_align(*allocp);
 
@@ -285,10 +575,12 @@ x86::Page* VirtualMemory::get_page(u32 address, bool make, x86::PageDirectory* d
 
   if(dir->tables[table_idx]) { // If this table is already assigned
     return &dir->tables[table_idx]->pages[address%1024];
+  } else if(x86::large_p(dir->tablesPhysical[table_idx])) {
+    // Covered by a 4M page, there's no table entry to hand out.
+    return 0;
   } else if(make) {
     u32 tmp;
-    dir->tables[table_idx] = (x86::PageTable*)kmalloc_ap(sizeof(x86::PageTable), &tmp);
-    memset((u8int*)dir->tables[table_idx], 0, cpu::cPageSize);
+    dir->tables[table_idx] = knew_phys_zeroed<x86::PageTable>(&tmp);
     dir->tablesPhysical[table_idx] = tmp | 0x7; // PRESENT, RW, US.
     return &dir->tables[table_idx]->pages[address%1024];
   } else {
@@ -304,6 +596,156 @@ x86::Page* VirtualMemory::get_current_page(u32 address, bool make) {
   return get_page(address, make, current_directory);
 }
 
+// Page directories only share the kernel tables that exist when they
+// are created, so regions of kernel space that are filled in later
+// must have their tables made up front.
+void VirtualMemory::reserve_kernel_tables(u32 start, u32 end) {
+  for(u32 addr = start; addr < end; addr += 1024 * cpu::cPageSize) {
+    get_kernel_page(addr, true);
+  }
+}
+
+// Works for addresses in the 4M pages of the linear mapping as well as
+// ones mapped through a table.
+u32 VirtualMemory::physical_address(u32 address) {
+  u32 entry = kernel_directory->tablesPhysical[address / x86::cLargePageSize];
+
+  if(x86::large_p(entry)) {
+    return (entry & x86::cLargePageMask) + (address & ~x86::cLargePageMask);
+  }
+
+  x86::Page* page = get_kernel_page(address, false);
+  return page->frame * cpu::cPageSize + (address & ~cpu::cPageMask);
+}
+
+// Back the 4M aligned address in the current directory with a single
+// large page. Fails if anything is mapped there already or there's
+// no free 4M block.
+bool VirtualMemory::map_large(u32 address, bool writable) {
+  u32 idx = address / x86::cLargePageSize;
+  x86::PageDirectory* dir = current_directory;
+
+  if(dir->tables[idx] || dir->tablesPhysical[idx]) return false;
+
+  u32 base;
+  if(!frames.alloc(BuddyAllocator::cMaxOrder, &base)) return false;
+
+  // PRESENT, US, and RW if asked for.
+  dir->tablesPhysical[idx] = (base * cpu::cPageSize) | x86::cLargePage |
+                             (writable ? 0x7 : 0x5);
+
+  memset((u8*)address, 0, x86::cLargePageSize);
+  return true;
+}
+
+// Turn a 4M page into a table of 4K pages over the same frames, so
+// they can be handled one at a time.
+void VirtualMemory::split_large(x86::PageDirectory* dir, u32 idx) {
+  u32 entry = dir->tablesPhysical[idx];
+  ASSERT(x86::large_p(entry));
+
+  u32 phys;
+  x86::PageTable* table = knew_phys_zeroed<x86::PageTable>(&phys);
+
+  u32 base = (entry & x86::cLargePageMask) / cpu::cPageSize;
+
+  // A user page made inaccessible has its user bit clear too, so the
+  // kernel side is told apart by address.
+  bool kernel = idx >= KERNEL_VIRTUAL_BASE / x86::cLargePageSize;
+
+  for(int i = 0; i < 1024; i++) {
+    table->pages[i].assign(base + i, entry & 0x2, kernel);
+    if(!kernel && (entry & 0x4) == 0) table->pages[i].user = 0;
+  }
+
+  dir->tables[idx] = table;
+  dir->tablesPhysical[idx] = phys | 0x07;
+
+  if(dir == current_directory) cpu::flush_tbl();
+}
+
+// Map a frame into a free slot of the KMAP window so the kernel can
+// get at its contents. Pair with unmap_scratch.
+void* VirtualMemory::map_scratch(u32 frame) {
+  u32 slot = KMAP_SLOTS;
+
+  synchronized(scratch_lock) {
+    for(u32 i = 0; i < KMAP_SLOTS; i++) {
+      if((scratch_used[i / 32] & (1 << (i % 32))) == 0) {
+        scratch_used[i / 32] |= (1 << (i % 32));
+        slot = i;
+        break;
+      }
+    }
+  }
+
+  if(slot == KMAP_SLOTS) PANIC("Out of scratch mappings");
+
+  u32 addr = KMAP_START + slot * cpu::cPageSize;
+
+  get_kernel_page(addr, false)->assign(frame, true, true);
+  cpu::invalidate_page(addr);
+
+  return (void*)addr;
+}
+
+void VirtualMemory::unmap_scratch(void* ptr) {
+  u32 addr = (u32)ptr & cpu::cPageMask;
+  u32 slot = (addr - KMAP_START) / cpu::cPageSize;
+
+  ASSERT(slot < KMAP_SLOTS);
+
+  get_kernel_page(addr, false)->clear();
+  cpu::invalidate_page(addr);
+
+  synchronized(scratch_lock) {
+    scratch_used[slot / 32] &= ~(1 << (slot % 32));
+  }
+}
+
+// Give the current address space its own copy of a copy-on-write
+// page. Returns false if the page at address isn't copy-on-write.
+bool VirtualMemory::break_cow(u32 address) {
+  u32 page_address = address & cpu::cPageMask;
+
+  x86::Page* p = get_current_page(page_address, false);
+  if(!p || !p->present || !p->cow) return false;
+
+  // Everyone else already let go of it, so just take it back.
+  if(p->frame != zero_frame && frames.count(p->frame) == 1) {
+    p->rw = 1;
+    p->cow = 0;
+    cpu::invalidate_page(page_address);
+    return true;
+  }
+
+  u32 old = p->frame;
+  u32 idx;
+
+  // A page that was all zeros can start from an already cleared frame.
+  bool zeroed = (old == zero_frame) && zero_pool::take(&idx);
+
+  if(!zeroed) {
+    if(!reclaim::alloc(0, &idx)) kabort();
+
+    void* copy = map_scratch(idx);
+
+    if(old == zero_frame) {
+      memset((u8*)copy, 0, cpu::cPageSize);
+    } else {
+      memcpy((u8*)copy, (u8*)page_address, cpu::cPageSize);
+    }
+
+    unmap_scratch(copy);
+  }
+
+  p->assign(idx, true, false);
+  cpu::invalidate_page(page_address);
+
+  if(old != zero_frame) frames.put(old);
+  return true;
+}
+
 x86::Page* VirtualMemory::allocate_user(u32 page, bool writable) {
   x86::Page* p = get_current_page(page, true);
   alloc_user_frame(p, writable);
@@ -311,33 +753,35 @@ x86::Page* VirtualMemory::allocate_user(u32 page, bool writable) {
 }
 
 
-extern "C" void copy_page_physical(int, int);
-
 x86::PageTable* VirtualMemory::clone_table(x86::PageTable* src, u32 *phys) {
-  // Make a new page table, which is page aligned.
-  x86::PageTable* table = knew_phys<x86::PageTable>(phys);
-
-  // Ensure that the new table is blank.
-  memset((u8int*)table, 0, sizeof(x86::PageTable));
+  // Make a new, blank page table, which is page aligned.
+  x86::PageTable* table = knew_phys_zeroed<x86::PageTable>(phys);
 
   // For every entry in the table...
   for(int i = 0; i < 1024; i++) {
+    x86::Page& page = src->pages[i];
+
+    // Both sides now refer to the same swap slot.
+    if(page.swapped) {
+      swap::dup(page.frame);
+      table->pages[i] = page;
+      continue;
+    }
+
     // If the source entry has a frame associated with it...
-    if(!src->pages[i].frame) continue;
+    if(!page.present || !page.frame) continue;
 
-    // Get a new frame.
-    alloc_user_frame(&table->pages[i]);
+    // Share the frame rather than copying it. Writable pages become
+    // read-only on both sides, and whoever writes first gets a copy.
+    if(page.frame != zero_frame) frames.get(page.frame);
 
-    // Clone the flags from source to destination.
-    if(src->pages[i].present)  table->pages[i].present = 1;
-    if(src->pages[i].rw)       table->pages[i].rw = 1;
-    if(src->pages[i].user)     table->pages[i].user = 1;
-    if(src->pages[i].accessed) table->pages[i].accessed = 1;
-    if(src->pages[i].dirty)    table->pages[i].dirty = 1;
+    if(page.rw) {
+      page.rw = 0;
+      page.cow = 1;
+    }
 
-    // Physically copy the data across. This function is in process.s.
-    copy_page_physical(  src->pages[i].frame * cpu::cPageSize,
-                       table->pages[i].frame * cpu::cPageSize);
+    table->pages[i] = page;
+    table->pages[i].ahead = 0;
   }
 
   return table;
@@ -352,12 +796,174 @@ void VirtualMemory::free_table(x86::PageTable* src) {
   kfree(src);
 }
 
+static bool table_empty_p(x86::PageTable* table) {
+  for(int i = 0; i < 1024; i++) {
+    if(table->pages[i].frame) return false;
+  }
+
+  return true;
+}
+
+void VirtualMemory::clear_user(x86::PageDirectory* dir) {
+  for(u32 idx = 0; idx < KERNEL_VIRTUAL_BASE / x86::cLargePageSize; idx++) {
+    x86::PageTable* table = dir->tables[idx];
+
+    if(!table) {
+      u32 entry = dir->tablesPhysical[idx];
+
+      if(x86::large_p(entry)) {
+        frames.free((entry & x86::cLargePageMask) / cpu::cPageSize,
+                    BuddyAllocator::cMaxOrder);
+        dir->tablesPhysical[idx] = 0;
+      }
+
+      continue;
+    }
+
+    if(kernel_directory->tables[idx] == table) continue;
+
+    for(int i = 0; i < 1024; i++) {
+      if(table->pages[i].frame) free_frame(&table->pages[i]);
+    }
+
+    // free_frame leaves the access bits behind.
+    memset((u8*)table, 0, sizeof(x86::PageTable));
+  }
+
+  // User entries aren't global, a reload drops them all.
+  if(dir == current_directory) cpu::flush_tbl();
+}
+
+void VirtualMemory::unmap_range(x86::PageDirectory* dir, u32 start, u32 end) {
+  ASSERT(end <= KERNEL_VIRTUAL_BASE);
+
+  bool current = (dir == current_directory);
+  u32 addr = start;
+
+  while(addr < end) {
+    u32 idx = addr / x86::cLargePageSize;
+    u32 table_start = idx * x86::cLargePageSize;
+    u32 table_end = table_start + x86::cLargePageSize;
+    u32 stop = min(end, table_end);
+
+    if(!dir->tables[idx]) {
+      u32 entry = dir->tablesPhysical[idx];
+
+      if(!x86::large_p(entry)) {
+        addr = stop;
+        continue;
+      }
+
+      if(addr == table_start && stop == table_end) {
+        frames.free((entry & x86::cLargePageMask) / cpu::cPageSize,
+                    BuddyAllocator::cMaxOrder);
+        dir->tablesPhysical[idx] = 0;
+        if(current) cpu::invalidate_page(table_start);
+
+        addr = stop;
+        continue;
+      }
+
+      split_large(dir, idx);
+    }
+
+    x86::PageTable* table = dir->tables[idx];
+
+    // Never tear into a table the kernel shares.
+    if(kernel_directory->tables[idx] == table) {
+      addr = stop;
+      continue;
+    }
+
+    for(; addr < stop; addr += cpu::cPageSize) {
+      x86::Page* page = &table->pages[(addr / cpu::cPageSize) % 1024];
+      if(!page->frame) continue;
+
+      free_frame(page);
+      if(current) cpu::invalidate_page(addr);
+    }
+
+    if(table_empty_p(table)) {
+      dir->tables[idx] = 0;
+      dir->tablesPhysical[idx] = 0;
+      kfree(table);
+
+      // Drops any cached reference to the table as well.
+      if(current) cpu::invalidate_page(table_start);
+    }
+  }
+}
+
+// Pages that become writable are marked copy-on-write rather than
+// made writable outright: they may be shared, or be the zero frame.
+// The first write sorts that out, and simply takes the page back if
+// nobody else has it.
+void VirtualMemory::protect_range(x86::PageDirectory* dir, u32 start, u32 end,
+                                  bool writable, bool accessible)
+{
+  ASSERT(end <= KERNEL_VIRTUAL_BASE);
+
+  bool current = (dir == current_directory);
+  u32 addr = start;
+
+  while(addr < end) {
+    u32 idx = addr / x86::cLargePageSize;
+    u32 table_start = idx * x86::cLargePageSize;
+    u32 table_end = table_start + x86::cLargePageSize;
+    u32 stop = min(end, table_end);
+
+    if(!dir->tables[idx]) {
+      u32 entry = dir->tablesPhysical[idx];
+
+      if(!x86::large_p(entry)) {
+        addr = stop;
+        continue;
+      }
+
+      // A user 4M page is never shared, so its entry can be changed
+      // in place.
+      if(addr == table_start && stop == table_end) {
+        entry = writable ? (entry | 0x2) : (entry & ~0x2);
+        entry = accessible ? (entry | 0x4) : (entry & ~0x4);
+        dir->tablesPhysical[idx] = entry;
+
+        if(current) cpu::invalidate_page(table_start);
+
+        addr = stop;
+        continue;
+      }
+
+      split_large(dir, idx);
+    }
+
+    x86::PageTable* table = dir->tables[idx];
+
+    if(kernel_directory->tables[idx] == table) {
+      addr = stop;
+      continue;
+    }
+
+    for(; addr < stop; addr += cpu::cPageSize) {
+      x86::Page* page = &table->pages[(addr / cpu::cPageSize) % 1024];
+      if(!page->frame) continue;
+
+      if(writable) {
+        if(!page->rw) page->cow = 1;
+      } else {
+        page->rw = 0;
+      }
+
+      page->user = accessible ? 1 : 0;
+
+      if(current) cpu::invalidate_page(addr);
+    }
+  }
+}
+
 x86::PageDirectory* VirtualMemory::new_directory() {
   u32 phys;
-  // Make a new page directory and obtain its physical address.
-  x86::PageDirectory* dir = knew_phys<x86::PageDirectory>(&phys);
-  // Ensure that it is blank.
-  memset((u8int*)dir, 0, sizeof(x86::PageDirectory));
+  // Make a new, blank page directory and obtain its physical address.
+  x86::PageDirectory* dir = knew_phys_zeroed<x86::PageDirectory>(&phys);
 
   // Get the offset of tablesPhysical from the start of the page_directory
   // structure.
@@ -369,7 +975,7 @@ x86::PageDirectory* VirtualMemory::new_directory() {
   // Now copy the pointers over from the kernel directory because
   // they're constant.
   for(int i = 0; i < 1024; i++) {
-    if(kernel_directory->tables[i]) {
+    if(kernel_directory->tablesPhysical[i]) {
       dir->tables[i] = kernel_directory->tables[i];
       dir->tablesPhysical[i] = kernel_directory->tablesPhysical[i];
     }
@@ -380,10 +986,8 @@ x86::PageDirectory* VirtualMemory::new_directory() {
 
 x86::PageDirectory* VirtualMemory::clone_directory(x86::PageDirectory* src) {
   u32 phys;
-  // Make a new page directory and obtain its physical address.
-  x86::PageDirectory* dir = knew_phys<x86::PageDirectory>(&phys);
-  // Ensure that it is blank.
-  memset((u8int*)dir, 0, sizeof(x86::PageDirectory));
+  // Make a new, blank page directory and obtain its physical address.
+  x86::PageDirectory* dir = knew_phys_zeroed<x86::PageDirectory>(&phys);
 
   // Get the offset of tablesPhysical from the start of the page_directory structure.
   u32 offset = (u32)dir->tablesPhysical - (u32)dir;
@@ -393,7 +997,19 @@ x86::PageDirectory* VirtualMemory::clone_directory(x86::PageDirectory* src) {
 
   // Go through each page table. If the page table is in the kernel directory, do not make a new copy.
   for(int i = 0; i < 1024; i++) {
-    if(!src->tables[i]) continue;
+    if(!src->tables[i]) {
+      if(!x86::large_p(src->tablesPhysical[i])) continue;
+
+      // The kernel's 4M pages are shared like its tables. A process's
+      // own are split up first so the frames can be shared
+      // copy-on-write like any others.
+      if((u32)i >= KERNEL_VIRTUAL_BASE / x86::cLargePageSize) {
+        dir->tablesPhysical[i] = src->tablesPhysical[i];
+        continue;
+      }
+
+      split_large(src, i);
+    }
 
     if(kernel_directory->tables[i] == src->tables[i]) {
       // It's in the kernel, so just use the same pointer.
@@ -406,12 +1022,26 @@ x86::PageDirectory* VirtualMemory::clone_directory(x86::PageDirectory* src) {
       dir->tablesPhysical[i] = phys | 0x07;
     }
   }
+
+  // The source just lost write access to its shared pages.
+  if(src == current_directory) cpu::flush_tbl();
+
   return dir;
 }
 
 void VirtualMemory::free_directory(x86::PageDirectory* dir) {
   for(int i = 0; i < 1024; i++) {
-    if(!dir->tables[i]) continue;
+    if(!dir->tables[i]) {
+      u32 entry = dir->tablesPhysical[i];
+
+      if(x86::large_p(entry) &&
+         (u32)i < KERNEL_VIRTUAL_BASE / x86::cLargePageSize) {
+        frames.free((entry & x86::cLargePageMask) / cpu::cPageSize,
+                    BuddyAllocator::cMaxOrder);
+      }
+
+      continue;
+    }
 
     if(kernel_directory->tables[i] != dir->tables[i]) {
       free_table(dir->tables[i]);
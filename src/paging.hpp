@@ -12,32 +12,68 @@
 #define KERNEL_VIRTUAL_BASE 0xC0000000
 #define USER_STACK_SIZE 0x800000
 
+// A small window of kernel space for temporarily mapping frames that
+// aren't otherwise reachable, one page per slot.
+#define KMAP_START 0xD2000000
+#define KMAP_SLOTS 1024
+
 namespace x86 {
   struct Page {
     u32 present    : 1;   // Page present in memory
     u32 rw         : 1;   // Read-only if clear, readwrite if set
     u32 user       : 1;   // Supervisor level only if clear
+    u32 pwt        : 1;   // Write-through caching
+    u32 pcd        : 1;   // Caching disabled
     u32 accessed   : 1;   // Has the page been accessed since last refresh?
     u32 dirty      : 1;   // Has the page been written to since last refresh?
-    u32 unused     : 7;   // Amalgamation of unused and reserved bits
+    u32 pat        : 1;   // Page attribute table index
+    u32 global     : 1;   // Not flushed from the TLB on a CR3 reload
+    u32 cow        : 1;   // Available: shared copy-on-write, rw is clear
+    u32 ahead      : 1;   // Available: mapped by fault-around, not yet faulted on
+    u32 swapped    : 1;   // Available: not present, frame holds a swap slot
     u32 frame      : 20;  // Frame address (shifted right 12 bits)
 
     void assign(u32 f, bool write, bool kernel) {
       present = 1;
       rw = (write ? 1 : 0);
       user = (kernel ? 0 : 1);
+      // Kernel mappings are the same in every directory.
+      global = (kernel ? 1 : 0);
+      cow = 0;
+      ahead = 0;
+      swapped = 0;
       frame = f;
     }
 
     void clear() {
+      present = 0;
+      cow = 0;
+      ahead = 0;
+      swapped = 0;
       frame = 0;
     }
+
+    // Whether the entry stands for a page, in memory or in swap.
+    bool used_p() {
+      return present || swapped;
+    }
   };
 
   struct PageTable {
     Page pages[1024];
   };
 
+  // A directory entry with this bit set maps a whole 4M page itself
+  // rather than pointing at a table. CR4.PSE is turned on in boot.s.
+  const static u32 cLargePage = 0x80;
+  const static u32 cGlobalPage = 0x100;
+  const static u32 cLargePageSize = 0x400000;
+  const static u32 cLargePageMask = 0xFFC00000;
+
+  static inline bool large_p(u32 entry) {
+    return (entry & cLargePage) == cLargePage;
+  }
+
   struct PageDirectory {
     /**
       Array of pointers to pagetables.
@@ -73,14 +109,46 @@ class MemoryMapping {
 
   int flags_;
 
+  const static u32 cTableSpan = 1024 * cpu::cPageSize;
+
+  u32 file_offset(u32 page) {
+    return offset_ + (page - address_);
+  }
+
+  bool zero_p(u32 page) {
+    return page >= address_ && page - address_ >= file_size_;
+  }
+
+  bool shareable_p(u32 page) {
+    return node_ && !writable_p() &&
+           page >= address_ && page - address_ + cpu::cPageSize <= file_size_;
+  }
+
+  bool large_p(u32 page);
+  bool fulfill_large(u32 page);
+  u32 around_end(u32 page);
+  void fill(u32 start, u32 end, u32 fault, bool around=true);
+  void mark_ahead(x86::Page* p, u32 addr);
+
 public:
+  static u32 fault_around;
+
   enum Flags {
     eReadable = 1,
     eWritable = 2,
     eExecutable = 4,
-    eAll = 7
+    eAll = 7,
+
+    // Anonymous memory that may be backed by 4M pages.
+    eLargePages = 8,
+
+    // Populated and kept in memory, never swapped out.
+    eLocked = 16
   };
 
+  // Large pages are only worth it for mappings at least this big.
+  const static u32 cLargeThreshold = 0x800000;
+
   MemoryMapping(u32 address, u32 mem_size, fs::Node* node, u32 offset, u32 size,
                 int flags)
     : address_(address)
@@ -119,6 +187,33 @@ public:
     page_end_ = align(address_ + mem_size_, cpu::cPageSize);
   }
 
+  void reduce_mem_size(u32 amount) {
+    mem_size_ -= amount;
+    if(file_size_ > mem_size_) file_size_ = mem_size_;
+    page_end_ = align(address_ + mem_size_, cpu::cPageSize);
+  }
+
+  // Replace the access bits, keeping the rest of the flags.
+  void set_protection(int prot) {
+    flags_ = (flags_ & ~eAll) | (prot & eAll);
+  }
+
+  void set_locked(bool locked) {
+    flags_ = locked ? (flags_ | eLocked) : (flags_ & ~eLocked);
+  }
+
+  bool locked_p() {
+    return (flags_ & eLocked) == eLocked;
+  }
+
+  // Anonymous mappings with the same flags that meet end to end can
+  // become one.
+  bool mergeable_p(MemoryMapping* next) {
+    return !node_ && !next->node_ && flags_ == next->flags_ &&
+           end_address() == next->address_ &&
+           page_end_ == next->page_start_;
+  }
+
   fs::Node* node() {
     return node_;
   }
@@ -131,6 +226,22 @@ public:
     return file_size_;
   }
 
+  // Cut this mapping short at the page aligned addr and return the
+  // rest as a mapping of its own.
+  MemoryMapping split(u32 addr) {
+    u32 delta = addr - address_;
+    u32 file_rest = file_size_ > delta ? file_size_ - delta : 0;
+
+    MemoryMapping upper(addr, end_address() - addr, node_, offset_ + delta,
+                        file_rest, flags_);
+
+    mem_size_ = delta;
+    if(file_size_ > delta) file_size_ = delta;
+    page_end_ = addr;
+
+    return upper;
+  }
+
   bool contains_p(u32 addr) {
     return addr >= page_start_ && addr < page_end_;
     // return addr >= address_ && addr < address_ + mem_size_;
@@ -144,7 +255,16 @@ public:
     return (flags_ & eWritable) == eWritable;
   }
 
-  bool fulfill(Thread* task, u32 addr);
+  // Mapped with no access at all, any fault in it is an error.
+  bool inaccessible_p() {
+    return (flags_ & eAll) == 0;
+  }
+
+  bool fulfill(Thread* task, u32 addr, bool write);
+
+  // Map every page of [start, end) in the current directory, as a
+  // write to it would, so that none of them faults later.
+  void populate(u32 start, u32 end);
 };
 
 struct VirtualMemory {
@@ -154,8 +274,9 @@ struct VirtualMemory {
   // The current page directory;
   x86::PageDirectory* current_directory;
 
-  u32* frames;
-  u32  nframes;
+  // A frame of zeros, mapped read-only wherever anonymous memory has
+  // only been read so far.
+  u32 zero_frame;
 
   void init(u32 total_memory, u32 kstart, u32 kend, u32 mem_end);
 
@@ -176,68 +297,43 @@ struct VirtualMemory {
   x86::Page* get_page(u32* allocp, u32 address, bool make, x86::PageDirectory* dir);
   x86::Page* get_kernel_page(u32 address, bool make);
   x86::Page* get_current_page(u32 address, bool make);
+  void reserve_kernel_tables(u32 start, u32 end);
+
+  u32 physical_address(u32 address);
+  bool map_large(u32 address, bool writable);
+  void split_large(x86::PageDirectory* dir, u32 idx);
+
+  void* map_scratch(u32 frame);
+  void unmap_scratch(void* addr);
+
+  bool break_cow(u32 address);
   x86::PageDirectory* clone_directory(x86::PageDirectory* src);
   x86::PageDirectory* clone_current();
   x86::PageDirectory* new_directory();
 
   x86::Page* allocate_user(u32 page, bool writable);
 
+  // Release the frames behind the page aligned user range [start, end)
+  // of dir, and the tables left empty. 4M pages reaching outside the
+  // range are split first.
+  void unmap_range(x86::PageDirectory* dir, u32 start, u32 end);
+
+  // Release every user page of dir, for exec. The tables stay, empty,
+  // so the next image faults into them without allocating new ones.
+  void clear_user(x86::PageDirectory* dir);
+
+  // Change the access to the pages in [start, end). Pages that aren't
+  // accessible stay mapped, but only for the kernel, so user accesses
+  // fault until access is given back.
+  void protect_range(x86::PageDirectory* dir, u32 start, u32 end,
+                     bool writable, bool accessible=true);
+
   void free_table(x86::PageTable* tbl);
   void free_directory(x86::PageDirectory* dir);
 
   private:
 
   x86::PageTable* clone_table(x86::PageTable* src, u32* phys);
-
-// Macros used in the bitset algorithms.
-#define INDEX_FROM_BIT(a) (a/(8*4))
-#define OFFSET_FROM_BIT(a) (a%(8*4))
-
-
-  // Static function to set a bit in the frames bitset
-  void set_frame(u32 frame_addr) {
-    u32 frame = frame_addr/cpu::cPageSize;
-    u32 idx = INDEX_FROM_BIT(frame);
-    u32 off = OFFSET_FROM_BIT(frame);
-    frames[idx] |= (0x1 << off);
-  }
-
-  // Static function to clear a bit in the frames bitset
-  void clear_frame(u32 frame_addr) {
-    u32 frame = frame_addr/cpu::cPageSize;
-    u32 idx = INDEX_FROM_BIT(frame);
-    u32 off = OFFSET_FROM_BIT(frame);
-    frames[idx] &= ~(0x1 << off);
-  }
-
-  // Static function to test if a bit is set.
-  u32 test_frame(u32 frame_addr) {
-    u32 frame = frame_addr/cpu::cPageSize;
-    u32 idx = INDEX_FROM_BIT(frame);
-    u32 off = OFFSET_FROM_BIT(frame);
-    return (frames[idx] & (0x1 << off));
-  }
-
-  // Static function to find the first free frame.
-  u32 first_frame(bool& ok) {
-    ok = false;
-    for(u32 i = 0; i < INDEX_FROM_BIT(nframes); i++) {
-      // if this set is full, skip.
-      if(frames[i] == 0xFFFFFFFF) continue;
-
-      // at least one bit is free here.
-      for(u32 j = 0; j < 32; j++) {
-        u32 toTest = 0x1 << j;
-
-        if((frames[i] & toTest) == 0) {
-          ok = true;
-          return i*4*8+j;
-        }
-      }
-    }
-
-    return 0;
-  }
 };
 
 extern VirtualMemory vmem;
@@ -9,12 +9,15 @@
 #include "fs.hpp"
 #include "fs/devfs.hpp"
 
+slab::Cache Process::cache;
+
 Process::Process(int pid, PosixSession& session)
   : pid_(pid)
   , session_(session)
   , break_mapping_(0)
   , thread_ids_(0)
   , next_mmap_start_(cDefaultMMapStart)
+  , lock_future_(false)
 {
   for(int i = 0; i < 16; i++) {
     fds_[i] = 0;
@@ -25,13 +28,24 @@ Process::Process(int pid, PosixSession& session)
   }
 
   threads_.init();
+
+  memset((u8*)&working_set_, 0, sizeof(working_set_));
+  memset((u8*)&working_set_pass_, 0, sizeof(working_set_pass_));
+}
+
+void Process::publish_working_set(u32 ticks) {
+  working_set_pass_.scans = working_set_.scans + 1;
+  working_set_pass_.ticks = ticks;
+
+  working_set_ = working_set_pass_;
+  memset((u8*)&working_set_pass_, 0, sizeof(working_set_pass_));
 }
 
 void Process::add_mmap(fs::Node* node, u32 offset, u32 size, u32 addr,
                        u32 mem_size, int flags)
 {
   MemoryMapping mapping(addr, mem_size, node, offset, size, flags);
-  mmaps_.append(mapping);
+  mmaps_.insert(mapping);
 }
 
 int Process::open_file(const char* path, int mode) {
@@ -67,61 +81,103 @@ fs::File* Process::get_file(int fd) {
 }
 
 MemoryMapping* Process::find_mapping(u32 addr) {
-  Process::MMapList::Iterator i = mmaps_.begin();
+  return mmaps_.find(addr);
+}
 
-  while(i.more_p()) {
-    MemoryMapping& mmap = i.advance();
+// A forked child sees the same address space as its parent, so it
+// needs the same mappings to fault it in.
+void Process::copy_mmaps(Process* parent) {
+  for(u32 i = 0; i < parent->mmaps_.count(); i++) {
+    MemoryMapping* mmap = parent->mmaps_.at(i);
+    MemoryMapping* copy = mmaps_.insert(*mmap);
 
-    if(mmap.contains_p(addr)) {
-      return &mmap;
-    }
+    // Locks aren't inherited, the child's pages are only shared.
+    copy->set_locked(false);
+
+    if(mmap == parent->break_mapping_) break_mapping_ = copy;
   }
 
-  return 0;
+  next_mmap_start_ = parent->next_mmap_start_;
 }
 
-void Process::print_mmaps() {
-  auto i = mmaps_.begin();
+void Process::clear_mmaps() {
+  mmaps_.clear();
+  break_mapping_ = 0;
+}
 
-  while(i.more_p()) {
-    MemoryMapping& mmap = i.advance();
+void Process::clear_address_space() {
+  clear_mmaps();
+  next_mmap_start_ = cDefaultMMapStart;
+  lock_future_ = false;
+
+  vmem.clear_user(directory);
+
+  // Whatever the scanner saw of the old image is meaningless now.
+  memset((u8*)&working_set_pass_, 0, sizeof(working_set_pass_));
+}
+
+// Tables under no mapping stay empty, unmap_range frees them.
+void Process::trim_tables() {
+  for(u32 addr = 0; addr < KERNEL_VIRTUAL_BASE;
+      addr += x86::cLargePageSize) {
+    if(mmaps_.overlap_p(addr, addr + x86::cLargePageSize)) continue;
+
+    vmem.unmap_range(directory, addr, addr + x86::cLargePageSize);
+  }
+}
+
+void Process::print_mmaps() {
+  for(u32 i = 0; i < mmaps_.count(); i++) {
+    MemoryMapping* mmap = mmaps_.at(i);
 
     console.printf("%p-%p (%d) %s\n",
-                   mmap.page_start(), mmap.page_end(),
-                   mmap.mem_size(),
-                   mmap.writable_p() ? "read-write" : "read-only");
+                   mmap->page_start(), mmap->page_end(),
+                   mmap->mem_size(),
+                   mmap->writable_p() ? "read-write" : "read-only");
   }
 }
 
 
 u32 Process::change_heap(int bytes) {
   if(!break_mapping_) {
-    int flags = MemoryMapping::eAll;
+    int flags = new_mmap_flags(MemoryMapping::eAll | MemoryMapping::eLargePages);
     u32 addr = 0x2000000;
     MemoryMapping mapping(addr, bytes, 0, 0, 0, flags);
-    break_mapping_ = &mmaps_.append(mapping);
+    break_mapping_ = mmaps_.insert(mapping);
+
+    if(break_mapping_->locked_p()) populate(addr, break_mapping_->page_end());
     return addr;
   }
 
   u32 ret = break_mapping_->end_address();
+  u32 old_page_end = break_mapping_->page_end();
   break_mapping_->enlarge_mem_size(bytes);
+
+  if(break_mapping_->locked_p()) {
+    populate(old_page_end, break_mapping_->page_end());
+  }
+
   return ret;
 }
 
 u32 Process::new_mmap_region(u32 size) {
-  u32 addr = next_mmap_start_;
-  next_mmap_start_ += size;
+  size = align(size, cpu::cPageSize);
+
+  u32 addr = find_region(next_mmap_start_, size);
+  next_mmap_start_ = addr + size;
   return addr;
 }
 
 void Process::position_brk(u32 fin) {
-  MemoryMapping mapping(fin, 0, 0, 0, 0, MemoryMapping::eAll);
-  break_mapping_ = &mmaps_.append(mapping);
+  MemoryMapping mapping(fin, 0, 0, 0, 0,
+                        new_mmap_flags(MemoryMapping::eAll |
+                                       MemoryMapping::eLargePages));
+  break_mapping_ = mmaps_.insert(mapping);
 }
 
 u32 Process::set_brk(u32 target) {
   if(!break_mapping_) {
-    int flags = MemoryMapping::eAll;
+    int flags = new_mmap_flags(MemoryMapping::eAll | MemoryMapping::eLargePages);
     u32 addr = cDefaultBreakStart;
     u32 bytes = 0;
 
@@ -136,22 +192,262 @@ u32 Process::set_brk(u32 target) {
     }
 
     MemoryMapping mapping(addr, bytes, 0, 0, 0, flags);
-    break_mapping_ = &mmaps_.append(mapping);
+    break_mapping_ = mmaps_.insert(mapping);
+
+    if(break_mapping_->locked_p()) populate(addr, break_mapping_->page_end());
     return target;
   }
 
-  if(target == 0) {
-    return cDefaultBreakStart;
-  } else if(target < break_mapping_->end_address()) {
-    console.printf("ignoring request to reduce brk %p < %p\n",
-                   target, break_mapping_->end_address());
+  u32 end = break_mapping_->end_address();
+
+  if(target == 0) return end;
+
+  if(target < end) {
+    if(target < break_mapping_->address()) target = break_mapping_->address();
+
+    u32 old_page_end = break_mapping_->page_end();
+    break_mapping_->reduce_mem_size(end - target);
+
+    // Hand back the pages that are now past the break.
+    vmem.unmap_range(directory, break_mapping_->page_end(), old_page_end);
     return target;
   }
 
-  u32 ret = break_mapping_->end_address();
-  break_mapping_->enlarge_mem_size(target - ret);
+  // Growing into another mapping fails and leaves the break where it was.
+  u32 new_page_end = align(target, cpu::cPageSize);
+
+  if(new_page_end > break_mapping_->page_end() &&
+     mmaps_.overlap_p(break_mapping_->page_end(), new_page_end)) {
+    return end;
+  }
+
+  u32 old_page_end = break_mapping_->page_end();
+  break_mapping_->enlarge_mem_size(target - end);
+
+  if(break_mapping_->locked_p()) {
+    populate(old_page_end, break_mapping_->page_end());
+  }
+
   return target;
+}
+
+// Whether all of [start, end) is mapped.
+bool Process::mapped_p(u32 start, u32 end) {
+  for(u32 pos = start; pos < end;) {
+    MemoryMapping* m = mmaps_.find(pos);
+    if(!m) return false;
+
+    pos = m->page_end();
+  }
+
+  return true;
+}
+
+// Locked from the start after mlockall(MCL_FUTURE).
+int Process::new_mmap_flags(int flags) {
+  return lock_future_ ? (flags | MemoryMapping::eLocked) : flags;
+}
+
+// Split the mappings reaching over start or end, so that [start, end)
+// is made up of whole mappings.
+void Process::cut_mmaps(u32 start, u32 end) {
+  MemoryMapping* m = mmaps_.find(start);
+  if(m && m->page_start() < start) mmaps_.split(m, start);
+
+  m = mmaps_.find(end);
+  if(m && m->page_start() < end) mmaps_.split(m, end);
+}
+
+// Fold mapping together with the anonymous mappings on either side of
+// it, returning the mapping it ended up part of. The brk mapping
+// moves on its own, so it's left alone.
+MemoryMapping* Process::merge_mmap(MemoryMapping* mapping) {
+  if(mapping == break_mapping_) return mapping;
+
+  while(MemoryMapping* next = mmaps_.next(mapping)) {
+    if(next == break_mapping_ || !mapping->mergeable_p(next)) break;
+
+    mapping->enlarge_mem_size(next->mem_size());
+    mmaps_.remove(next);
+  }
+
+  MemoryMapping* prev = mmaps_.prev(mapping);
+
+  if(prev && prev != break_mapping_ && prev->mergeable_p(mapping)) {
+    prev->enlarge_mem_size(mapping->mem_size());
+    mmaps_.remove(mapping);
+    return prev;
+  }
+
+  return mapping;
+}
+
+// The first free stretch of size bytes, at hint if that's free.
+// Returns 0 if there's no room.
+u32 Process::find_region(u32 hint, u32 size) {
+  u32 limit = KERNEL_VIRTUAL_BASE - USER_STACK_SIZE;
+
+  if(size >= limit) return 0;
+
+  if(hint && hint + size > hint && hint + size <= limit &&
+     !mmaps_.overlap_p(hint, hint + size)) {
+    return hint;
+  }
+
+  u32 addr = cMMapBase;
+
+  while(addr + size <= limit) {
+    MemoryMapping* m = mmaps_.find_overlap(addr, addr + size);
+    if(!m) return addr;
+
+    addr = m->page_end();
+  }
+
+  return 0;
+}
+
+u32 Process::mmap(u32 addr, u32 size, int prot, int flags) {
+  // Files are only mapped by exec for now.
+  if((flags & eMapAnonymous) == 0 || size == 0) return (u32)-1;
+
+  // Sizes just short of 4G round up to nothing.
+  size = align(size, cpu::cPageSize);
+  if(size == 0) return (u32)-1;
+
+  if(flags & eMapFixed) {
+    if(addr & ~cpu::cPageMask) return (u32)-1;
+
+    u32 end = addr + size;
+    if(end < addr || end > KERNEL_VIRTUAL_BASE - USER_STACK_SIZE) {
+      return (u32)-1;
+    }
+
+    // Whatever was there is replaced.
+    munmap(addr, size);
+  } else {
+    addr = find_region(addr & cpu::cPageMask, size);
+    if(!addr) return (u32)-1;
+  }
+
+  int mflags = (prot & MemoryMapping::eAll) | MemoryMapping::eLargePages;
+  if(flags & eMapLocked) mflags |= MemoryMapping::eLocked;
+
+  MemoryMapping mapping(addr, size, 0, 0, 0, new_mmap_flags(mflags));
+  MemoryMapping* m = mmaps_.insert(mapping);
+  bool populated = m->locked_p() || (flags & eMapPopulate);
+
+  merge_mmap(m);
+
+  if(populated) populate(addr, addr + size);
+
+  return addr;
+}
+
+int Process::munmap(u32 addr, u32 size) {
+  if((addr & ~cpu::cPageMask) || size == 0) return -1;
+
+  u32 end = align(addr + size, cpu::cPageSize);
+  if(end < addr || end > KERNEL_VIRTUAL_BASE) return -1;
+
+  cut_mmaps(addr, end);
+
+  while(MemoryMapping* m = mmaps_.find_overlap(addr, end)) {
+    if(m == break_mapping_) break_mapping_ = 0;
+    mmaps_.remove(m);
+  }
+
+  vmem.unmap_range(directory, addr, end);
+  return 0;
+}
+
+int Process::mprotect(u32 addr, u32 size, int prot) {
+  if(addr & ~cpu::cPageMask) return -1;
+
+  u32 end = align(addr + size, cpu::cPageSize);
+  if(end < addr || end > KERNEL_VIRTUAL_BASE) return -1;
+  if(end == addr) return 0;
+
+  // All of the range has to be mapped.
+  if(!mapped_p(addr, end)) return -1;
+
+  cut_mmaps(addr, end);
+
+  for(u32 pos = addr; pos < end;) {
+    MemoryMapping* m = mmaps_.find(pos);
+    m->set_protection(prot);
+
+    pos = m->page_end();
+  }
 
+  vmem.protect_range(directory, addr, end,
+                     (prot & MemoryMapping::eWritable) != 0,
+                     (prot & MemoryMapping::eAll) != 0);
+
+  merge_mmap(mmaps_.find(addr));
+  return 0;
+}
+
+void Process::populate(u32 start, u32 end) {
+  for(u32 pos = start; pos < end;) {
+    MemoryMapping* m = mmaps_.find_overlap(pos, end);
+    if(!m) return;
+
+    u32 from = m->page_start() > pos ? m->page_start() : pos;
+    u32 to = m->page_end() < end ? m->page_end() : end;
+
+    if(!m->inaccessible_p()) m->populate(from, to);
+
+    pos = to;
+  }
+}
+
+int Process::mlock(u32 addr, u32 size, bool lock) {
+  u32 start = addr & cpu::cPageMask;
+  u32 end = align(addr + size, cpu::cPageSize);
+
+  if(end < start || end > KERNEL_VIRTUAL_BASE) return -1;
+  if(end == start) return 0;
+
+  if(!mapped_p(start, end)) return -1;
+
+  cut_mmaps(start, end);
+
+  for(u32 pos = start; pos < end;) {
+    MemoryMapping* m = mmaps_.find(pos);
+    m->set_locked(lock);
+
+    pos = m->page_end();
+  }
+
+  if(lock) populate(start, end);
+
+  merge_mmap(mmaps_.find(start));
+  return 0;
+}
+
+int Process::mlockall(int flags) {
+  if((flags & (eLockCurrent | eLockFuture)) == 0) return -1;
+
+  if(flags & eLockCurrent) {
+    for(u32 i = 0; i < mmaps_.count(); i++) {
+      mmaps_.at(i)->set_locked(true);
+    }
+
+    populate(0, KERNEL_VIRTUAL_BASE);
+  }
+
+  if(flags & eLockFuture) lock_future_ = true;
+
+  return 0;
+}
+
+int Process::munlockall() {
+  for(u32 i = 0; i < mmaps_.count(); i++) {
+    mmaps_.at(i)->set_locked(false);
+  }
+
+  lock_future_ = false;
+  return 0;
 }
 
 void Process::exit(int code) {
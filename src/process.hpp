@@ -7,11 +7,12 @@
 #include "fs.hpp"
 #include "list.hpp"
 #include "session.hpp"
+#include "slab.hpp"
+#include "mapping_index.hpp"
+#include "working_set.hpp"
 
 class Process {
 public:
-  typedef sys::ExternalList<MemoryMapping> MMapList;
-
   enum Lists {
     cAll = 0,
     cCleanup = 1,
@@ -22,18 +23,40 @@ public:
   const static u32 cDefaultBreakStart = 0x2000000;
   const static u32 cDefaultBreakSize  = 1024 * 1024;
 
+  // Anonymous mmaps without a usable hint are placed between here and
+  // the stack, well clear of brk.
+  const static u32 cMMapBase = 0x40000000;
+
+  // Linux i386 mmap flags.
+  enum MMapFlags {
+    eMapShared = 0x01,
+    eMapPrivate = 0x02,
+    eMapFixed = 0x10,
+    eMapAnonymous = 0x20,
+    eMapLocked = 0x2000,
+    eMapPopulate = 0x8000
+  };
+
+  // mlockall flags.
+  enum LockFlags {
+    eLockCurrent = 1,
+    eLockFuture = 2
+  };
+
   typedef sys::List<Process, cAll> AllList;
   typedef sys::List<Process, cCleanup> CleanupList;
 
   sys::ListNode<Process> lists[cTotal];
 
+  static slab::Cache cache;
+
 private:
   sys::ExternalList<Thread*> threads_;
   int pid_;
 
   PosixSession session_;
 
-  MMapList mmaps_;
+  MappingIndex mmaps_;
 
   MemoryMapping* break_mapping_;
 
@@ -47,6 +70,19 @@ private:
 
   u32 next_mmap_start_;
 
+  // Set by mlockall(MCL_FUTURE): new mappings start out locked.
+  bool lock_future_;
+
+  // The last complete working set sample, and the one being built.
+  working_set::Sample working_set_;
+  working_set::Sample working_set_pass_;
+
+  u32 find_region(u32 hint, u32 size);
+  bool mapped_p(u32 start, u32 end);
+  void cut_mmaps(u32 start, u32 end);
+  int new_mmap_flags(int flags);
+  MemoryMapping* merge_mmap(MemoryMapping* mapping);
+
 public:
   x86::PageDirectory* directory;
 
@@ -77,6 +113,14 @@ public:
     threads_.append(thr);
   }
 
+  void remove_thread(Thread* thr) {
+    threads_.remove(thr);
+  }
+
+  sys::ExternalList<Thread*>& threads() {
+    return threads_;
+  }
+
   PosixSession& session() {
     return session_;
   }
@@ -88,6 +132,13 @@ public:
   void add_mmap(fs::Node* node, u32 offset, u32 size, u32 addr,
                 u32 mem_size, int flags);
   MemoryMapping* find_mapping(u32 addr);
+  void copy_mmaps(Process* parent);
+  void clear_mmaps();
+
+  // For exec: drop the old image, keeping the page tables around for
+  // the new one, then free those the new one didn't reuse.
+  void clear_address_space();
+  void trim_tables();
   u32 change_heap(int bytes);
   u32 set_brk(u32 target);
 
@@ -102,7 +153,29 @@ public:
 
   u32 new_mmap_region(u32 size);
 
+  // Anonymous private memory. Returns the address or -1.
+  u32 mmap(u32 addr, u32 size, int prot, int flags);
+  int munmap(u32 addr, u32 size);
+  int mprotect(u32 addr, u32 size, int prot);
+
+  // Fault in whatever isn't there yet of the mappings in [start, end).
+  void populate(u32 start, u32 end);
+
+  int mlock(u32 addr, u32 size, bool lock);
+  int mlockall(int flags);
+  int munlockall();
+
   void print_mmaps();
+
+  working_set::Sample& working_set() {
+    return working_set_;
+  }
+
+  working_set::Sample& working_set_pass() {
+    return working_set_pass_;
+  }
+
+  void publish_working_set(u32 ticks);
 };
 
 #endif
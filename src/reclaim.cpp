@@ -0,0 +1,108 @@
+#include "reclaim.hpp"
+#include "buddy.hpp"
+#include "kheap.hpp"
+#include "scheduler.hpp"
+#include "spinlock.hpp"
+#include "scope.hpp"
+#include "stats.hpp"
+
+namespace reclaim {
+  static Shrinker* list = 0;
+  static SpinLock lock;
+
+  // Set while the shrinkers run. Whatever they allocate themselves
+  // must not send us back in.
+  static bool running = false;
+
+  static Thread* reclaimer = 0;
+  static volatile bool sleeping = false;
+
+  void add(Shrinker* shrinker) {
+    synchronized(lock) {
+      Shrinker** pos = &list;
+      while(*pos && (*pos)->rank <= shrinker->rank) pos = &(*pos)->next;
+
+      shrinker->next = *pos;
+      *pos = shrinker;
+    }
+  }
+
+  u32 run(u32 target) {
+    u32 freed = 0;
+
+    synchronized(lock) {
+      if(running) return 0;
+      running = true;
+    }
+
+    stats.reclaim_runs.inc();
+
+    // Growing the heap takes frames, and freeing into it halfway
+    // through would pull it out from under grow.
+    bool heap_busy = kheap && kheap->growing;
+
+    for(Shrinker* s = list; s && freed < target; s = s->next) {
+      if(s->heap && heap_busy) continue;
+
+      u32 got = s->shrink(target - freed);
+      s->freed += got;
+      freed += got;
+    }
+
+    stats.reclaim_pages.add(freed);
+
+    synchronized(lock) {
+      running = false;
+    }
+
+    return freed;
+  }
+
+  bool alloc(u32 order, u32* frame) {
+    bool ok = frames.alloc(order, frame);
+
+    if(!ok) {
+      run(cBatch + (1 << order));
+      ok = frames.alloc(order, frame);
+    }
+
+    if(frames.free_frames() < cLowWatermark) wake();
+
+    return ok;
+  }
+
+  void wake() {
+    if(!reclaimer) return;
+
+    int st = cpu::disable_interrupts();
+
+    if(sleeping) {
+      sleeping = false;
+      scheduler.make_ready(reclaimer);
+    }
+
+    cpu::restore_interrupts(st);
+  }
+
+  static void reclaimer_loop() {
+    for(;;) {
+      while(frames.free_frames() < cHighWatermark) {
+        if(run(cBatch) == 0) break;
+      }
+
+      // Interrupts stay off until we're off the ready queue, so a wake
+      // can't slip in between and queue us twice.
+      int st = cpu::disable_interrupts();
+
+      auto token = scheduler.start_io();
+      sleeping = true;
+      scheduler.io_wait(token);
+
+      cpu::restore_interrupts(st);
+    }
+  }
+
+  void start() {
+    reclaimer = scheduler.spawn_thread(reclaimer_loop);
+  }
+}
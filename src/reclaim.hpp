@@ -0,0 +1,65 @@
+#ifndef RECLAIM_HPP
+#define RECLAIM_HPP
+
+#include "common.hpp"
+
+class Thread;
+
+// Kernel caches grow for as long as nobody else wants the memory. When
+// free frames run low, the caches are asked to give some back: first
+// by the background reclaimer, and as a last resort by whoever is
+// allocating.
+namespace reclaim {
+  // Below this many free frames allocations wake the reclaimer.
+  const static u32 cLowWatermark = 64;
+
+  // The reclaimer keeps going until this many frames are free.
+  const static u32 cHighWatermark = 256;
+
+  // Frames asked for per shrinker pass.
+  const static u32 cBatch = 32;
+
+  // Shrinkers run in rank order. A cache that holds on to objects of
+  // another cache must rank below it, so those objects can go too.
+  enum Rank {
+    eFrames = 0,    // Whole frames, given back directly.
+    eIndexes = 1,   // Lookups into other caches.
+    eBuffers = 2,   // Block device data.
+    eObjects = 3,   // Slab pages emptied by the others.
+    eSwap = 4       // Process memory written out, the last resort.
+  };
+
+  struct Shrinker {
+    const char* name;
+
+    // Release roughly target frames worth of memory, return how much
+    // went. Only ever called from one thread at a time.
+    u32 (*shrink)(u32 target);
+
+    u8 rank;
+
+    // Gives memory back with kfree, so it can't run while the heap is
+    // in the middle of growing.
+    bool heap;
+
+    Shrinker* next;
+    u32 freed;
+  };
+
+  // Shrinkers are usually statically allocated, add only links them in.
+  void add(Shrinker* shrinker);
+
+  // Ask the shrinkers for target frames. Returns the number released.
+  u32 run(u32 target);
+
+  // frames.alloc, reclaiming before giving up.
+  bool alloc(u32 order, u32* frame);
+
+  // Start the background reclaimer thread.
+  void start();
+
+  // Let the reclaimer know frames are getting low.
+  void wake();
+}
+
+#endif
@@ -453,25 +453,32 @@ void RTL8139::init() {
   enable_tx_rx();
   set_config();
 
-  u32int phys_rx_ring = 0;
-  u32int virt_rx_ring = kmalloc_ap(default_rx_buf_len + 16, &phys_rx_ring);
+  // The card only knows the ring by its physical address, so it has
+  // to be one contiguous run.
+  if(!dma::alloc(default_rx_buf_len + 16, &rx_ring)) {
+    PANIC("rtl8139: no memory for the rx ring");
+  }
 
   console.write("rtl8139: phys=");
-  console.write_hex(phys_rx_ring);
+  console.write_hex(rx_ring.phys);
   console.write(" virt=");
-  console.write_hex(virt_rx_ring);
+  console.write_hex(rx_ring.virt);
   console.write("\n");
 
-  set_rx_buffer(phys_rx_ring);
-  rx_buffer = virt_rx_ring;
+  set_rx_buffer(rx_ring.phys);
+  rx_buffer = rx_ring.virt;
   cur_rx = 0;
 
   // u32int tx_desc = 4;
-  u32int tx_buf_size = 1546;
+  u32int tx_buf_size = 2048;
+
+  if(!dma::alloc(tx_buf_size * 4, &tx_ring)) {
+    PANIC("rtl8139: no memory for the tx buffers");
+  }
 
   for(int i = 0; i < 4; i++) {
-    tx_buffers[i].virt = kmalloc_p(tx_buf_size,
-        &tx_buffers[i].phys);
+    tx_buffers[i].virt = tx_ring.virt + i * tx_buf_size;
+    tx_buffers[i].phys = tx_ring.phys + i * tx_buf_size;
 
     int j;
     u8int* buf = (u8int*)tx_buffers[i].virt;
@@ -1,5 +1,6 @@
 #include "io.hpp"
 #include "common.hpp"
+#include "dma.hpp"
 
 struct RTL8139 {
   IOPort ctrl;
@@ -16,6 +17,9 @@ struct RTL8139 {
 
   struct tx_buffer tx_buffers[4];
 
+  dma::Region rx_ring;
+  dma::Region tx_ring;
+
   int tx_desc;
   char mac[6];
 
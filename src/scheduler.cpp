@@ -10,6 +10,8 @@
 
 #include "percpu.hpp"
 #include "stats.hpp"
+#include "zero_pool.hpp"
+#include "kstack.hpp"
 
 #include "keyboard.hpp"
 
@@ -22,6 +24,9 @@ extern "C" void new_thread_tramp();
 
 extern "C" u8 initial_task;
 
+// STACKSIZE in boot.s.
+const static u32 cBootStackSize = 0x1000;
+
 void Scheduler::init() {
   // Rather important stuff happening, no interrupts please!
   cpu::disable_interrupts();
@@ -35,20 +40,22 @@ void Scheduler::init() {
   ready_queue_.init();
   waiting_queue_.init();
 
+  Process::cache.init("process", sizeof(Process));
+
   // Initialise the first thread (kernel thread)
   u32 mem = (u32)&initial_task;
 
   PosixSession init_session(PosixSession::Init);
 
   // Create process 0, the idle process.
-  Process* proc = new(kheap) Process(0,init_session);
+  Process* proc = new(Process::cache) Process(0,init_session);
   proc->directory = vmem.current_directory;
 
   processes_[proc->pid()] = proc;
   
   Thread* th = proc->new_thread((void*)mem);
   th->directory = vmem.current_directory;
-  th->kernel_stack = mem + KERNEL_STACK_SIZE;
+  th->kernel_stack = mem + cBootStackSize;
 
   th->state_ = Thread::eReady;
 
@@ -63,6 +70,12 @@ void Scheduler::init() {
 }
 
 void Scheduler::cleanup() {
+  Thread* th;
+
+  while(finished_.shift(&th)) {
+    kstack::release((u32)th);
+  }
+
   Process::CleanupList::Iterator i = cleanup_.begin();
 
   while(i.more_p()) {
@@ -70,7 +83,14 @@ void Scheduler::cleanup() {
     cleanup_.unlink(proc);
     processes_[proc->pid()] = 0;
 
+    // Nothing of the process is running any more, cleanup happens on
+    // the idle thread.
+    while(proc->threads().shift(&th)) {
+      kstack::release((u32)th);
+    }
+
     vmem.free_directory(proc->directory);
+    proc->clear_mmaps();
 
     kfree(proc);
   }
@@ -101,6 +121,8 @@ void Scheduler::on_idle() {
     cleanup();
   }
 
+  zero_pool::refill(zero_pool::cRefillBudget);
+
   switch_thread();
 }
 
@@ -124,6 +146,7 @@ bool Scheduler::switch_thread() {
 
   Thread* next = 0;
   bool switched = false;
+  u32 directory = 0;
 
   synchronized(lock_) {
     if(ready_queue_.count() == 0) {
@@ -146,6 +169,13 @@ bool Scheduler::switch_thread() {
 
     switched = true;
 
+    // Threads sharing an address space (those of one process, kernel
+    // threads, the idle thread) don't need CR3 reloaded, which would
+    // only throw away their TLB entries.
+    if(next->directory != vmem.current_directory) {
+      directory = next->directory->physicalAddr;
+    }
+
     // Make sure the memory manager knows we've changed page directory.
     vmem.current_directory = next->directory;
 
@@ -155,7 +185,7 @@ bool Scheduler::switch_thread() {
 
   PerCPU::set_thread(next);
 
-  restore_registers(&next->regs, vmem.current_directory->physicalAddr);
+  restore_registers(&next->regs, directory);
 
 done:
   cpu::restore_interrupts(st);
@@ -203,7 +233,8 @@ int Scheduler::wait_any(int *status) {
 }
 
 void Scheduler::sleep(int secs) {
-  ASSERT(getpid() != 0);
+  // Kernel threads may sleep, the idle thread never does.
+  ASSERT(current() != idle_thread_);
 
   synchronized(lock_) {
     current()->sleep_til(secs);
@@ -223,7 +254,8 @@ Scheduler::IOToken Scheduler::start_io() {
 }
 
 void Scheduler::io_wait(IOToken) {
-  ASSERT(getpid() != 0);
+  // Kernel threads may wait, the idle thread never does.
+  ASSERT(current() != idle_thread_);
 
   synchronized(lock_) {
     // Between the time of start_io and io_wait, the IO
@@ -250,18 +282,15 @@ int Scheduler::fork() {
     x86::PageDirectory* directory = vmem.clone_current();
 
     // Create a new process.
-    proc = new(kheap) Process(new_pid(), session());
+    proc = new(Process::cache) Process(new_pid(), session());
     processes_[proc->pid()] = proc;
 
     proc->directory = directory;
+    proc->copy_mmaps(process());
   }
 
-  u32 mem = kmalloc_a(KERNEL_STACK_SIZE);
-
-  Thread* new_thread = proc->new_thread((void*)mem);
-  new_thread->directory = proc->directory;
-
-  new_thread->kernel_stack = mem + KERNEL_STACK_SIZE;
+  Thread* new_thread = create_thread(proc);
+  proc->add_thread(new_thread);
 
   make_ready(new_thread);
 
@@ -285,12 +314,30 @@ void Scheduler::start_new_thread(void (*func)(), Thread* th) {
 
   synchronized(lock_) {
     ready_queue_.unlink(current());
+
+    // We're still running on its stack, so it's left to cleanup.
+    th->process()->remove_thread(th);
+    finished_.append(th);
   }
 
-  // TODO cleanup th somehow
   switch_thread();
 }
 
+// A new thread of proc, placed at the top of a stack of its own so
+// that an overflow runs into the guard page rather than through it.
+Thread* Scheduler::create_thread(Process* proc) {
+  u32 top = kstack::alloc() + KERNEL_STACK_SIZE;
+  u32 at = (top - sizeof(Thread)) & ~0xF;
+
+  Thread* thread = proc->new_thread((void*)at);
+
+  // A thread runs in the address space of its process.
+  thread->directory = proc->directory;
+  thread->kernel_stack = at;
+
+  return thread;
+}
+
 int Scheduler::spawn_init(void (*func)(void)) {
   // We are modifying kernel structures, and so cannot be interrupted.
   int st = cpu::disable_interrupts();
@@ -301,18 +348,13 @@ int Scheduler::spawn_init(void (*func)(void)) {
     x86::PageDirectory* directory = vmem.new_directory();
 
     // Create a new process.
-    proc = new(kheap) Process(1, session());
+    proc = new(Process::cache) Process(1, session());
     processes_[1] = proc;
 
     proc->directory = directory;
   }
 
-  u32 mem = kmalloc_a(KERNEL_STACK_SIZE);
-
-  Thread* new_thread = proc->new_thread((void*)mem);
-  new_thread->directory = proc->directory;
-  new_thread->kernel_stack = mem + KERNEL_STACK_SIZE;
-
+  Thread* new_thread = create_thread(proc);
   proc->add_thread(new_thread);
 
   make_ready(new_thread);
@@ -333,31 +375,21 @@ Thread* Scheduler::spawn_thread(void (*func)()) {
   // We are modifying kernel structures, and so cannot be interrupted.
   int st = cpu::disable_interrupts();
 
-  // Clone the address space.
-  x86::PageDirectory* directory;
-  
-  synchronized(lock_) {
-    directory = vmem.clone_current();
-  }
-
-  // Create a new process.
-  u32 mem = kmalloc_a(KERNEL_STACK_SIZE);
-
-  Thread* new_thread = 0;
+  Process* proc = process();
+  Thread* new_thread = create_thread(proc);
 
   synchronized(lock_) {
-    new_thread = process()->new_thread((void*)mem);
+    proc->add_thread(new_thread);
   }
 
-  new_thread->directory = directory;
-  new_thread->kernel_stack = mem + KERNEL_STACK_SIZE;
-
   save_registers(&new_thread->regs);
   new_thread->regs.eip = (u32)new_thread_tramp;
   new_thread->regs.esp = new_thread->kernel_stack;
   new_thread->regs.ebp = (u32)func;
   new_thread->regs.ebx = (u32)new_thread;
 
+  make_ready(new_thread);
+
   // All finished: Reenable interrupts.
   cpu::restore_interrupts(st);
 
@@ -20,6 +20,9 @@ class Scheduler {
 
   sys::ExternalList<Thread*> hiprio_threads_;
 
+  // Kernel threads that returned, their stacks still to be freed.
+  sys::ExternalList<Thread*> finished_;
+
   Thread* idle_thread_;
 
   console_driver::ConsoleDevice* console_;
@@ -79,6 +82,7 @@ public:
 
   int fork();
 
+  Thread* create_thread(Process* proc);
   void start_new_thread(void (*func)(), Thread* th);
   Thread* spawn_thread(void (*func)(void));
   int spawn_init(void (*func)(void));
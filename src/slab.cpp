@@ -0,0 +1,257 @@
+#include "slab.hpp"
+#include "kheap.hpp"
+#include "paging.hpp"
+#include "cpu.hpp"
+#include "scope.hpp"
+#include "reclaim.hpp"
+
+namespace slab {
+  static Cache classes[cNumClasses];
+
+  static const char* class_names[cNumClasses] = {
+    "size-16", "size-32", "size-64", "size-128",
+    "size-256", "size-512", "size-1024", "size-2048"
+  };
+
+  // One entry per page of the region, indexed by page number.
+  static PageInfo* pages = 0;
+
+  // Region pages that were used once and given back. Their frames
+  // have been released, only the virtual page is kept.
+  static PageInfo* free_pages = 0;
+
+  // Region pages above this have never been handed out.
+  static u32 next_page = SLAB_START;
+
+  static SpinLock region_lock;
+
+  static inline PageInfo* page_info(void* ptr) {
+    return &pages[((u32)ptr - SLAB_START) / cpu::cPageSize];
+  }
+
+  static inline u32 page_address(PageInfo* info) {
+    return SLAB_START + (info - pages) * cpu::cPageSize;
+  }
+
+  static PageInfo* map_page() {
+    PageInfo* info = 0;
+
+    synchronized(region_lock) {
+      if(free_pages) {
+        info = free_pages;
+        free_pages = info->next;
+      } else if(next_page < SLAB_END) {
+        info = page_info((void*)next_page);
+        next_page += cpu::cPageSize;
+      }
+    }
+
+    if(!info) return 0;
+
+    u32 addr = page_address(info);
+    vmem.alloc_kernel_frame(vmem.get_kernel_page(addr, false), true);
+
+    return info;
+  }
+
+  static void unmap_page(PageInfo* info) {
+    u32 addr = page_address(info);
+
+    vmem.free_frame(vmem.get_kernel_page(addr, false));
+    cpu::invalidate_page(addr);
+
+    info->cache = 0;
+    info->prev = 0;
+
+    synchronized(region_lock) {
+      info->next = free_pages;
+      free_pages = info;
+    }
+  }
+
+  void Cache::init(const char* name, u32 size) {
+    if(size < sizeof(void*)) size = sizeof(void*);
+
+    name_ = name;
+    object_size_ = align(size, sizeof(void*));
+    per_page_ = cpu::cPageSize / object_size_;
+
+    ASSERT(per_page_ > 0);
+
+    partial_ = 0;
+    empty_ = 0;
+    pages_ = 0;
+    in_use_ = 0;
+    allocs_ = 0;
+  }
+
+  void Cache::link(PageInfo* info) {
+    info->prev = 0;
+    info->next = partial_;
+    if(partial_) partial_->prev = info;
+    partial_ = info;
+  }
+
+  void Cache::unlink(PageInfo* info) {
+    if(info->next) info->next->prev = info->prev;
+
+    if(info->prev) {
+      info->prev->next = info->next;
+    } else {
+      partial_ = info->next;
+    }
+
+    info->next = info->prev = 0;
+  }
+
+  void* Cache::alloc() {
+    synchronized(lock_) {
+      PageInfo* info = partial_;
+
+      if(!info) {
+        info = map_page();
+        if(!info) return 0;
+
+        // Thread every object in the new page onto its freelist.
+        u8* base = (u8*)page_address(info);
+
+        info->cache = this;
+        info->in_use = 0;
+        info->free = 0;
+
+        for(u32 i = per_page_; i > 0; i--) {
+          void** obj = (void**)(base + (i - 1) * object_size_);
+          *obj = info->free;
+          info->free = obj;
+        }
+
+        link(info);
+        pages_++;
+        empty_++;
+      }
+
+      void* obj = info->free;
+      info->free = *(void**)obj;
+
+      if(info->in_use++ == 0) empty_--;
+
+      // Full pages are not tracked; they come back on the first free.
+      if(!info->free) unlink(info);
+
+      in_use_++;
+      allocs_++;
+
+      return obj;
+    }
+
+    return 0;
+  }
+
+  void Cache::free(void* obj, PageInfo* info) {
+    synchronized(lock_) {
+      bool was_full = (info->free == 0);
+
+      *(void**)obj = info->free;
+      info->free = obj;
+
+      in_use_--;
+
+      if(was_full) link(info);
+
+      if(--info->in_use == 0) {
+        // Keep one empty page around to absorb alloc/free churn,
+        // give the rest back.
+        if(empty_ > 0) {
+          unlink(info);
+          pages_--;
+          unmap_page(info);
+        } else {
+          empty_++;
+        }
+      }
+    }
+  }
+
+  u32 Cache::shrink() {
+    u32 released = 0;
+
+    synchronized(lock_) {
+      PageInfo* info = partial_;
+
+      while(info && empty_ > 0) {
+        PageInfo* next = info->next;
+
+        if(info->in_use == 0) {
+          unlink(info);
+          pages_--;
+          empty_--;
+          unmap_page(info);
+          released++;
+        }
+
+        info = next;
+      }
+    }
+
+    return released;
+  }
+
+  static u32 shrink(u32 target) {
+    u32 released = 0;
+
+    for(u32 i = 0; i < cNumClasses && released < target; i++) {
+      released += classes[i].shrink();
+    }
+
+    return released;
+  }
+
+  static reclaim::Shrinker shrinker = {
+    "slab", shrink, reclaim::eObjects, false, 0, 0
+  };
+
+  void init() {
+    u32 count = (SLAB_END - SLAB_START) / cpu::cPageSize;
+
+    vmem.reserve_kernel_tables(SLAB_START, SLAB_END);
+
+    PageInfo* table = (PageInfo*)kmalloc(count * sizeof(PageInfo));
+    memset((u8*)table, 0, count * sizeof(PageInfo));
+
+    for(u32 i = 0; i < cNumClasses; i++) {
+      classes[i].init(class_names[i], cMinSize << i);
+    }
+
+    pages = table;
+
+    reclaim::add(&shrinker);
+  }
+
+  void* alloc(u32 size) {
+    if(!pages || size > cMaxSize) return 0;
+
+    u32 i = 0;
+    while((cMinSize << i) < size) i++;
+
+    return classes[i].alloc();
+  }
+
+  void free(void* ptr) {
+    PageInfo* info = page_info(ptr);
+    ASSERT(info->cache);
+
+    info->cache->free(ptr, info);
+  }
+
+  u32 object_size(void* ptr) {
+    PageInfo* info = page_info(ptr);
+    ASSERT(info->cache);
+
+    return info->cache->object_size();
+  }
+
+  Cache* size_class(u32 i) {
+    if(i >= cNumClasses) return 0;
+    return &classes[i];
+  }
+}
@@ -0,0 +1,107 @@
+#ifndef SLAB_HPP
+#define SLAB_HPP
+
+#include "common.hpp"
+#include "spinlock.hpp"
+#include "kheap.hpp"
+
+// Small kernel objects are carved out of whole pages living in their
+// own region of kernel space, so kfree can tell them apart from Heap
+// blocks by address alone and they carry no header or footer.
+#define SLAB_START 0xD0000000
+#define SLAB_END   0xD2000000
+
+namespace slab {
+  const static u32 cMinSize = 16;
+  const static u32 cMaxSize = 2048;
+  const static u32 cNumClasses = 8;
+
+  class Cache;
+
+  // Bookkeeping for one page of the slab region. Kept in a side table
+  // rather than in the page itself so that objects can use all of it.
+  struct PageInfo {
+    Cache* cache;
+    PageInfo* next;
+    PageInfo* prev;
+    void* free;
+    u32 in_use;
+  };
+
+  class Cache {
+    const char* name_;
+    u32 object_size_;
+    u32 per_page_;
+
+    PageInfo* partial_;
+    u32 empty_;
+
+    u32 pages_;
+    u32 in_use_;
+    u32 allocs_;
+
+    SpinLock lock_;
+
+    void link(PageInfo* info);
+    void unlink(PageInfo* info);
+
+  public:
+    void init(const char* name, u32 size);
+
+    const char* name() {
+      return name_;
+    }
+
+    u32 object_size() {
+      return object_size_;
+    }
+
+    u32 pages() {
+      return pages_;
+    }
+
+    u32 in_use() {
+      return in_use_;
+    }
+
+    u32 allocs() {
+      return allocs_;
+    }
+
+    // Whether alloc can be served without mapping a new page.
+    bool room_p() {
+      return partial_ != 0;
+    }
+
+    void* alloc();
+    void free(void* obj, PageInfo* info);
+
+    // Give back the empty pages kept for reuse. Returns how many.
+    u32 shrink();
+  };
+
+  void init();
+
+  static inline bool contains_p(void* ptr) {
+    return (u32)ptr >= SLAB_START && (u32)ptr < SLAB_END;
+  }
+
+  // Returns 0 if the size is too big for any class or the region is
+  // exhausted, in which case the caller should fall back to the Heap.
+  void* alloc(u32 size);
+  void free(void* ptr);
+
+  // The usable size of an object from alloc.
+  u32 object_size(void* ptr);
+
+  Cache* size_class(u32 i);
+}
+
+inline void* operator new(unsigned int sz, slab::Cache& cache) {
+  ASSERT(sz <= cache.object_size());
+  void* obj = cache.alloc();
+  if(!obj) obj = (void*)kmalloc(sz);
+  return obj;
+}
+
+#endif
@@ -41,6 +41,25 @@ public:
     line_ = l;
   }
 
+  // Unlike lock, this fails if the lock is held at all, even by the
+  // calling thread.
+  bool try_lock() {
+    bool ints = cpu::interrupts_enabled_p();
+
+    if(ints) cpu::disable_interrupts();
+
+    if(!__sync_bool_compare_and_swap(&locker_, 0, PerCPU::thread())) {
+      if(ints) cpu::enable_interrupts();
+      return false;
+    }
+
+    enable_interrupts_ = ints;
+    file_ = 0;
+    line_ = -1;
+
+    return true;
+  }
+
   void unlock() {
     Thread* cur = PerCPU::thread();
 
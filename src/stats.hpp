@@ -6,6 +6,21 @@
 struct Stats {
   AtomicInt<int> fast_io;
   AtomicInt<int> slow_io;
+
+  // Pages mapped ahead of a fault, and how many of those were touched
+  // by the time they were unmapped.
+  AtomicInt<int> fault_around_mapped;
+  AtomicInt<int> fault_around_used;
+
+  // Times the shrinkers were run, and the frames they gave back.
+  AtomicInt<int> reclaim_runs;
+  AtomicInt<int> reclaim_pages;
+
+  // Pages written to and read back from swap, and faults that found
+  // their page still in the swap cache.
+  AtomicInt<int> swap_outs;
+  AtomicInt<int> swap_ins;
+  AtomicInt<int> swap_cache_hits;
 };
 
 extern Stats stats;
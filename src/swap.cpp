@@ -0,0 +1,529 @@
+#include "swap.hpp"
+#include "block.hpp"
+#include "paging.hpp"
+#include "buddy.hpp"
+#include "vmalloc.hpp"
+#include "console.hpp"
+#include "scheduler.hpp"
+#include "process.hpp"
+#include "reclaim.hpp"
+#include "spinlock.hpp"
+#include "scope.hpp"
+#include "stats.hpp"
+#include "kheap.hpp"
+#include "working_set.hpp"
+
+namespace swap {
+  struct Area {
+    Backend* backend;
+    int priority;
+
+    // The global slots [start, end) belong to this area.
+    u32 start;
+    u32 end;
+
+    u32 next;
+    u32 nfree;
+  };
+
+  // Highest priority first.
+  static Area areas[cMaxAreas];
+  static u32 nareas = 0;
+
+  // Slot 0 is never handed out, a zero frame field means "nothing
+  // here".
+  static u32 nslots = 0;
+  static u32 nfree = 0;
+
+  // Page table entries referring to each slot, 0 if the slot is free.
+  static u16* counts = 0;
+
+  // The swap cache: a frame that still holds a slot's data, or 0. It
+  // has a reference of its own, so pages shared since fork are read
+  // in once, and the other entries find them here.
+  static u32* cached = 0;
+  static u32 ncached = 0;
+
+  // The clock hand: a process and an address within it.
+  static int hand_pid = 1;
+  static u32 hand_addr = 0;
+
+  static SpinLock lock;
+
+  // Where mkswap leaves its signature in the first page.
+  const static u32 cSignatureOffset = 4086;
+
+  // Used only when there's nothing better, like zram.
+  const static int cDevicePriority = 0;
+
+  // A swap partition. Its first page is the header.
+  class DeviceBackend : public Backend {
+    block::SubDevice* dev_;
+    u32 size_;
+
+  public:
+    DeviceBackend(block::SubDevice* dev, u32 size)
+      : dev_(dev)
+      , size_(size)
+    {}
+
+    const char* name() {
+      return dev_->name();
+    }
+
+    u32 size() {
+      return size_;
+    }
+
+    bool write(u32 slot, u8* page) {
+      return dev_->write_sectors((slot + 1) * cSectorsPerSlot,
+                                 cSectorsPerSlot, page);
+    }
+
+    bool read(u32 slot, u8* page) {
+      return dev_->read_sectors((slot + 1) * cSectorsPerSlot,
+                                cSectorsPerSlot, page);
+    }
+  };
+
+  static Area* area_for(u32 slot) {
+    for(u32 i = 0; i < nareas; i++) {
+      if(slot >= areas[i].start && slot < areas[i].end) return &areas[i];
+    }
+
+    PANIC("swap: slot outside every area");
+    return 0;
+  }
+
+  static u32 alloc_slot(Area* area) {
+    synchronized(lock) {
+      if(area->nfree == 0) return 0;
+
+      for(u32 i = area->start; i < area->end; i++) {
+        u32 slot = area->next;
+        if(++area->next == area->end) area->next = area->start;
+
+        if(counts[slot] == 0) {
+          counts[slot] = 1;
+          area->nfree--;
+          nfree--;
+          return slot;
+        }
+      }
+    }
+
+    return 0;
+  }
+
+  void dup(u32 slot) {
+    synchronized(lock) {
+      ASSERT(slot < nslots && counts[slot] > 0 && counts[slot] < 0xFFFF);
+      counts[slot]++;
+    }
+  }
+
+  void release(u32 slot) {
+    u32 frame = 0;
+
+    synchronized(lock) {
+      ASSERT(slot < nslots && counts[slot] > 0);
+      if(--counts[slot] > 0) return;
+
+      frame = cached[slot];
+      cached[slot] = 0;
+      if(frame) ncached--;
+
+      Area* area = area_for(slot);
+      area->nfree++;
+      nfree++;
+
+      // Before anyone can have the slot again.
+      area->backend->discard(slot - area->start);
+    }
+
+    if(frame) frames.put(frame);
+  }
+
+  static bool transfer_slot(u32 slot, u32 frame, bool write) {
+    Area* area = area_for(slot);
+
+    u8* data = (u8*)vmem.map_scratch(frame);
+    bool ok;
+
+    if(write) {
+      ok = area->backend->write(slot - area->start, data);
+    } else {
+      ok = area->backend->read(slot - area->start, data);
+    }
+
+    vmem.unmap_scratch(data);
+    return ok;
+  }
+
+  // The entry for addr, if the process still has the same directory
+  // and a table there.
+  static x86::Page* lookup(int pid, x86::PageDirectory* dir, u32 addr) {
+    Process* proc = scheduler.find_process(pid);
+    if(!proc || proc->directory != dir) return 0;
+
+    x86::PageTable* table = dir->tables[addr / x86::cLargePageSize];
+    if(!table) return 0;
+
+    return &table->pages[(addr / cpu::cPageSize) % 1024];
+  }
+
+  // Give back a dirty bit that swap_out took, if the entry still
+  // holds the frame.
+  static void restore_dirty(int pid, x86::PageDirectory* dir, u32 addr,
+                            u32 frame)
+  {
+    int st = cpu::disable_interrupts();
+
+    x86::Page* p = lookup(pid, dir, addr);
+    if(p && p->present && p->frame == frame) p->dirty = 1;
+
+    cpu::restore_interrupts(st);
+  }
+
+  // Write the page out, then swap the entry over to the slot, unless
+  // the page was written to or went away while the write was going.
+  // The dirty bit is cleared to catch such writes, and put back if the
+  // slot isn't committed.
+  static bool swap_out(int pid, x86::PageDirectory* dir, u32 addr,
+                       u32 frame, bool dirty)
+  {
+    // Keep the frame ours until we're done with it.
+    frames.get(frame);
+
+    // An area may turn the page down, the next one can still take it.
+    u32 slot = 0;
+
+    for(u32 i = 0; i < nareas && !slot; i++) {
+      slot = alloc_slot(&areas[i]);
+
+      if(slot && !transfer_slot(slot, frame, true)) {
+        release(slot);
+        slot = 0;
+      }
+    }
+
+    if(!slot) {
+      if(dirty) restore_dirty(pid, dir, addr, frame);
+      frames.put(frame);
+      return false;
+    }
+
+    bool done = false;
+
+    int st = cpu::disable_interrupts();
+
+    x86::Page* p = lookup(pid, dir, addr);
+
+    if(p && p->present && p->frame == frame && !p->dirty) {
+      p->present = 0;
+      p->swapped = 1;
+      p->accessed = 0;
+      p->frame = slot;
+
+      if(dir == vmem.current_directory) cpu::invalidate_page(addr);
+      done = true;
+    }
+
+    cpu::restore_interrupts(st);
+
+    if(!done) {
+      if(dirty) restore_dirty(pid, dir, addr, frame);
+      frames.put(frame);
+      release(slot);
+      return false;
+    }
+
+    frames.put(frame);
+
+    // And the reference the entry had.
+    frames.put(frame);
+    stats.swap_outs.inc();
+
+    return true;
+  }
+
+  static void next_process() {
+    if(++hand_pid >= constants::cMaxProcesses) hand_pid = 1;
+    hand_addr = 0;
+  }
+
+  // Sweep the hand over the user page tables. A page that was used
+  // since the hand last passed gets its accessed bit cleared and is
+  // left alone; one that wasn't is written out. Pages the working set
+  // scanner saw used within its window are passed over too, but that's
+  // only a preference: frames start out at age 0 and the scanner is
+  // slow to age them, so if a whole scan frees nothing the hand goes
+  // round again by the accessed bits alone.
+  u32 evict(u32 target) {
+    if(nareas == 0) return 0;
+
+    u32 freed = 0;
+    u32 scanned = 0;
+    bool by_age = true;
+
+    while(freed < target && nfree > 0) {
+      if(scanned == cScanLimit) {
+        if(freed > 0 || !by_age) break;
+
+        by_age = false;
+        scanned = 0;
+      }
+
+      scanned++;
+
+      Process* proc = scheduler.find_process(hand_pid);
+
+      if(!proc || !proc->directory || hand_addr >= KERNEL_VIRTUAL_BASE) {
+        next_process();
+        continue;
+      }
+
+      x86::PageDirectory* dir = proc->directory;
+      bool current = (dir == vmem.current_directory);
+
+      u32 idx = hand_addr / x86::cLargePageSize;
+      x86::PageTable* table = dir->tables[idx];
+
+      // 4M pages and tables the kernel shares aren't ours to swap.
+      if(!table || vmem.kernel_directory->tables[idx] == table) {
+        hand_addr = (idx + 1) * x86::cLargePageSize;
+        continue;
+      }
+
+      // Locked mappings stay in memory, so skip all of one.
+      MemoryMapping* m = proc->find_mapping(hand_addr);
+
+      if(m && m->locked_p()) {
+        hand_addr = m->page_end();
+        continue;
+      }
+
+      u32 addr = hand_addr;
+      hand_addr += cpu::cPageSize;
+
+      x86::Page* p = &table->pages[(addr / cpu::cPageSize) % 1024];
+
+      if(!p->present || !p->user || p->frame == vmem.zero_frame) continue;
+
+      // Shared since fork or with the page cache. Without a way back
+      // to the other entries it has to stay.
+      if(frames.count(p->frame) != 1) continue;
+
+      // Clearing the bit would hide the use from the working set
+      // scanner, so tell it here.
+      if(p->accessed) {
+        p->accessed = 0;
+        frames.set_age(p->frame, 0);
+        if(current) cpu::invalidate_page(addr);
+        continue;
+      }
+
+      if(by_age && frames.age(p->frame) < working_set::cWindow) continue;
+
+      // Any write during swap_out sets it again.
+      bool dirty = p->dirty;
+      p->dirty = 0;
+      if(current) cpu::invalidate_page(addr);
+
+      if(swap_out(hand_pid, dir, addr, p->frame, dirty)) freed++;
+    }
+
+    return freed;
+  }
+
+  bool fault(u32 addr) {
+    if(nareas == 0) return false;
+
+    u32 page = addr & cpu::cPageMask;
+
+    x86::Page* p = vmem.get_current_page(page, false);
+    if(!p || !p->swapped) return false;
+
+    u32 slot = p->frame;
+    u32 frame = 0;
+
+    synchronized(lock) {
+      frame = cached[slot];
+      if(frame) frames.get(frame);
+    }
+
+    if(frame) {
+      stats.swap_cache_hits.inc();
+    } else {
+      if(!reclaim::alloc(0, &frame)) kabort();
+
+      // The disk may be busy with a read of its own. Leave the entry
+      // alone, the access faults again and has another go.
+      if(!transfer_slot(slot, frame, false)) {
+        frames.put(frame);
+        return true;
+      }
+
+      stats.swap_ins.inc();
+
+      // Other entries still want this slot, save them the read.
+      synchronized(lock) {
+        if(counts[slot] > 1 && !cached[slot]) {
+          frames.get(frame);
+          cached[slot] = frame;
+          ncached++;
+        }
+      }
+    }
+
+    int st = cpu::disable_interrupts();
+
+    // Someone else in this address space may have beaten us to it.
+    p = vmem.get_current_page(page, false);
+
+    if(p && p->swapped && p->frame == slot) {
+      bool writable = p->rw || p->cow;
+
+      p->swapped = 0;
+      p->present = 1;
+      p->dirty = 0;
+      p->frame = frame;
+
+      release(slot);
+
+      // Still in the swap cache, or mapped by whoever read it in.
+      if(writable && frames.count(frame) > 1) {
+        p->rw = 0;
+        p->cow = 1;
+      }
+
+      cpu::invalidate_page(page);
+    } else {
+      frames.put(frame);
+    }
+
+    cpu::restore_interrupts(st);
+
+    return true;
+  }
+
+  // Frames in the swap cache that nobody has mapped are a copy of what
+  // is on disk already.
+  static u32 shrink_cache(u32 target) {
+    u32 released = 0;
+
+    for(u32 slot = 1; slot < nslots && ncached > 0 && released < target;
+        slot++) {
+      u32 frame = 0;
+
+      synchronized(lock) {
+        frame = cached[slot];
+
+        if(frame && frames.count(frame) == 1) {
+          cached[slot] = 0;
+          ncached--;
+        } else {
+          frame = 0;
+        }
+      }
+
+      if(frame) {
+        frames.put(frame);
+        released++;
+      }
+    }
+
+    return released;
+  }
+
+  static reclaim::Shrinker cache_shrinker = {
+    "swap-cache", shrink_cache, reclaim::eFrames, false, 0, 0
+  };
+
+  static reclaim::Shrinker evictor = {
+    "swap", evict, reclaim::eSwap, false, 0, 0
+  };
+
+  void add(Backend* backend, int priority) {
+    synchronized(lock) {
+      if(nareas == cMaxAreas) {
+        console.printf("swap: too many areas, ignoring %s\n", backend->name());
+        return;
+      }
+
+      u32 start = nslots ? nslots : 1;
+      u32 size = backend->size();
+      if(start + size > cMaxSlots) size = cMaxSlots - start;
+      if(size == 0) return;
+
+      u16* c = (u16*)vmalloc::realloc(counts, (start + size) * sizeof(u16));
+      if(!c) return;
+      counts = c;
+
+      u32* k = (u32*)vmalloc::realloc(cached, (start + size) * sizeof(u32));
+      if(!k) return;
+      cached = k;
+
+      memset((u8*)(counts + nslots), 0, (start + size - nslots) * sizeof(u16));
+      memset((u8*)(cached + nslots), 0, (start + size - nslots) * sizeof(u32));
+
+      u32 pos = nareas;
+      while(pos > 0 && areas[pos - 1].priority < priority) {
+        areas[pos] = areas[pos - 1];
+        pos--;
+      }
+
+      Area& area = areas[pos];
+      area.backend = backend;
+      area.priority = priority;
+      area.start = start;
+      area.end = start + size;
+      area.next = start;
+      area.nfree = size;
+
+      if(nareas++ == 0) {
+        reclaim::add(&cache_shrinker);
+        reclaim::add(&evictor);
+      }
+
+      nslots = start + size;
+      nfree += size;
+
+      console.printf("swap: %s, %dkB, priority %d\n",
+                     backend->name(), size * 4, priority);
+    }
+  }
+
+  void add_device(block::SubDevice* dev) {
+    u8* header = (u8*)vmalloc::alloc(cpu::cPageSize);
+    if(!header) return;
+
+    bool ok = dev->read_sectors(0, cSectorsPerSlot, header) &&
+              strncmp((char*)header + cSignatureOffset, "SWAPSPACE2", 10) == 0;
+
+    vmalloc::free(header);
+
+    if(!ok) {
+      console.printf("swap: no swap signature on %s, not using it\n",
+                     dev->name());
+      return;
+    }
+
+    u32 slots = dev->sectors() / cSectorsPerSlot;
+    if(slots < 2) return;
+
+    add(new(kheap) DeviceBackend(dev, slots - 1), cDevicePriority);
+  }
+
+  bool enabled_p() {
+    return nareas > 0;
+  }
+
+  u32 total_slots() {
+    return nslots ? nslots - 1 : 0;
+  }
+
+  u32 free_slots() {
+    return nfree;
+  }
+}
@@ -0,0 +1,68 @@
+#ifndef SWAP_HPP
+#define SWAP_HPP
+
+#include "common.hpp"
+
+namespace block {
+  class SubDevice;
+}
+
+// When frames run out, process pages nobody has touched lately are
+// written to a swap partition. Their page table entries keep the
+// slot the data went to, and the page fault handler reads it back.
+namespace swap {
+  // The partition type Linux uses for swap. The partition must also
+  // have been set up with mkswap.
+  const static u8 cPartitionType = 0x82;
+
+  const static u32 cSectorsPerSlot = 0x1000 / 512;
+
+  // Page table entries looked at per eviction pass before giving up.
+  const static u32 cScanLimit = 4096;
+
+  const static u32 cMaxAreas = 4;
+
+  // Slots have to fit in the frame field of a page table entry.
+  const static u32 cMaxSlots = 1 << 20;
+
+  // Somewhere pages can be written to. Slot numbers are relative to
+  // the backend's own area, starting at 0.
+  class Backend {
+  public:
+    virtual const char* name() = 0;
+    virtual u32 size() = 0;
+
+    // Either may fail, in which case swap tries the next area.
+    virtual bool write(u32 slot, u8* page) = 0;
+    virtual bool read(u32 slot, u8* page) = 0;
+
+    // Nothing refers to the slot any more.
+    virtual void discard(u32 slot) {}
+  };
+
+  // Pages go to the area with the highest priority that takes them.
+  void add(Backend* backend, int priority);
+
+  // Use a partition as a swap area.
+  void add_device(block::SubDevice* dev);
+
+  bool enabled_p();
+
+  // Bring back the page at addr in the current address space. Returns
+  // false if it isn't in swap.
+  bool fault(u32 addr);
+
+  // Another page table entry now refers to slot.
+  void dup(u32 slot);
+
+  // A page table entry referring to slot went away.
+  void release(u32 slot);
+
+  // Write out up to target pages, returns how many frames were freed.
+  u32 evict(u32 target);
+
+  u32 total_slots();
+  u32 free_slots();
+}
+
+#endif
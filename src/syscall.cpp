@@ -37,6 +37,9 @@ SYSCALL(17, exec, Registers* regs) {
   elf::Loader loader(req);
 
   if(!loader.load_into(scheduler.process())) {
+    // No image left to return to.
+    if(loader.replaced_p()) scheduler.exit(-1);
+
     regs->eax = -1;
     return 0;
   }
@@ -252,6 +255,45 @@ SYSCALL(34, close, int fd) {
   }
 }
 
+// Only anonymous memory is supported, so the file offset that would
+// be the sixth argument is never needed.
+SYSCALL(35, mmap, u32 addr, u32 size, int prot, int flags, int fd) {
+  return (int)scheduler.process()->mmap(addr, size, prot, flags);
+}
+
+SYSCALL(36, munmap, u32 addr, u32 size) {
+  return scheduler.process()->munmap(addr, size);
+}
+
+SYSCALL(37, mprotect, u32 addr, u32 size, int prot) {
+  return scheduler.process()->mprotect(addr, size, prot);
+}
+
+SYSCALL(39, mlock, u32 addr, u32 size) {
+  return scheduler.process()->mlock(addr, size, true);
+}
+
+SYSCALL(40, munlock, u32 addr, u32 size) {
+  return scheduler.process()->mlock(addr, size, false);
+}
+
+SYSCALL(41, mlockall, int flags) {
+  return scheduler.process()->mlockall(flags);
+}
+
+SYSCALL(42, munlockall) {
+  return scheduler.process()->munlockall();
+}
+
+// Fills in a working_set::Sample. pid 0 is the caller.
+SYSCALL(38, working_set, int pid, void* out) {
+  working_set::Sample sample;
+  if(!working_set::sample(pid, &sample)) return -1;
+
+  memcpy((u8*)out, (u8*)&sample, sizeof(sample));
+  return 0;
+}
+
 
 /*
 struct stat {
@@ -31,3 +31,11 @@ DECL_SYSCALL2(getcwd, char*, int);
 DECL_SYSCALL4(rt_sigaction, int, void*, void*, int);
 DECL_SYSCALL3(fcntl, int, int, void*);
 DECL_SYSCALL1(close, int);
+DECL_SYSCALL5(mmap, u32, u32, int, int, int);
+DECL_SYSCALL2(munmap, u32, u32);
+DECL_SYSCALL3(mprotect, u32, u32, int);
+DECL_SYSCALL2(working_set, int, void*);
+DECL_SYSCALL2(mlock, u32, u32);
+DECL_SYSCALL2(munlock, u32, u32);
+DECL_SYSCALL1(mlockall, int);
+DECL_SYSCALL0(munlockall);
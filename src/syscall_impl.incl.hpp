@@ -31,3 +31,11 @@ DEFN_SYSCALL2(getcwd, 31, char*, int);
 DEFN_SYSCALL4(rt_sigaction, 32, int, void*, void*, int);
 DEFN_SYSCALL3(fcntl, 33, int, int, void*);
 DEFN_SYSCALL1(close, 34, int);
+DEFN_SYSCALL5(mmap, 35, u32, u32, int, int, int);
+DEFN_SYSCALL2(munmap, 36, u32, u32);
+DEFN_SYSCALL3(mprotect, 37, u32, u32, int);
+DEFN_SYSCALL2(working_set, 38, int, void*);
+DEFN_SYSCALL2(mlock, 39, u32, u32);
+DEFN_SYSCALL2(munlock, 40, u32, u32);
+DEFN_SYSCALL1(mlockall, 41, int);
+DEFN_SYSCALL0(munlockall, 42);
@@ -173,6 +173,46 @@ void _syscall_tramp_close(Registers* regs) {
   regs->eax = SYSCALL_NAME(close)((int)regs->ebx);
   TRACE_END_SYSCALL(34);
 }
+void _syscall_tramp_mmap(Registers* regs) {
+  TRACE_START_SYSCALL(35);
+  regs->eax = SYSCALL_NAME(mmap)((u32)regs->ebx, (u32)regs->ecx, (int)regs->edx, (int)regs->esi, (int)regs->edi);
+  TRACE_END_SYSCALL(35);
+}
+void _syscall_tramp_munmap(Registers* regs) {
+  TRACE_START_SYSCALL(36);
+  regs->eax = SYSCALL_NAME(munmap)((u32)regs->ebx, (u32)regs->ecx);
+  TRACE_END_SYSCALL(36);
+}
+void _syscall_tramp_mprotect(Registers* regs) {
+  TRACE_START_SYSCALL(37);
+  regs->eax = SYSCALL_NAME(mprotect)((u32)regs->ebx, (u32)regs->ecx, (int)regs->edx);
+  TRACE_END_SYSCALL(37);
+}
+void _syscall_tramp_working_set(Registers* regs) {
+  TRACE_START_SYSCALL(38);
+  regs->eax = SYSCALL_NAME(working_set)((int)regs->ebx, (void*)regs->ecx);
+  TRACE_END_SYSCALL(38);
+}
+void _syscall_tramp_mlock(Registers* regs) {
+  TRACE_START_SYSCALL(39);
+  regs->eax = SYSCALL_NAME(mlock)((u32)regs->ebx, (u32)regs->ecx);
+  TRACE_END_SYSCALL(39);
+}
+void _syscall_tramp_munlock(Registers* regs) {
+  TRACE_START_SYSCALL(40);
+  regs->eax = SYSCALL_NAME(munlock)((u32)regs->ebx, (u32)regs->ecx);
+  TRACE_END_SYSCALL(40);
+}
+void _syscall_tramp_mlockall(Registers* regs) {
+  TRACE_START_SYSCALL(41);
+  regs->eax = SYSCALL_NAME(mlockall)((int)regs->ebx);
+  TRACE_END_SYSCALL(41);
+}
+void _syscall_tramp_munlockall(Registers* regs) {
+  TRACE_START_SYSCALL(42);
+  regs->eax = SYSCALL_NAME(munlockall)();
+  TRACE_END_SYSCALL(42);
+}
 static void* syscalls[] = {
   (void*)&_syscall_tramp_kprint,
   (void*)&_syscall_tramp_fork,
@@ -209,9 +249,17 @@ static void* syscalls[] = {
   (void*)&_syscall_tramp_rt_sigaction,
   (void*)&_syscall_tramp_fcntl,
   (void*)&_syscall_tramp_close,
+  (void*)&_syscall_tramp_mmap,
+  (void*)&_syscall_tramp_munmap,
+  (void*)&_syscall_tramp_mprotect,
+  (void*)&_syscall_tramp_working_set,
+  (void*)&_syscall_tramp_mlock,
+  (void*)&_syscall_tramp_munlock,
+  (void*)&_syscall_tramp_mlockall,
+  (void*)&_syscall_tramp_munlockall,
   0
 };
-const static u32 num_syscalls = 35;
+const static u32 num_syscalls = 43;
 static const char* syscall_names[] = {
   "kprint",
   "fork",
@@ -248,5 +296,13 @@ static const char* syscall_names[] = {
   "rt_sigaction",
   "fcntl",
   "close",
+  "mmap",
+  "munmap",
+  "mprotect",
+  "working_set",
+  "mlock",
+  "munlock",
+  "mlockall",
+  "munlockall",
   0
 };
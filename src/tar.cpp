@@ -2,6 +2,7 @@
 #include "tar.hpp"
 #include "console.hpp"
 #include "fs/tmpfs.hpp"
+#include "vmalloc.hpp"
 
 #include "zlib.h"
 #include "zutil.h"
@@ -75,12 +76,20 @@ namespace tar {
     , size_(size)
   {}
 
+  // The inflate window is too big to be worth a run of heap.
+  static const u32 cLargeAlloc = 16 * 1024;
+
   static void* my_zalloc(void* cookie, uInt items, uInt size) {
+    if(items * size >= cLargeAlloc) return vmalloc::alloc(items * size);
     return (void*)kmalloc(items * size);
   }
 
   static void my_zfree(void* cookie, void* addr) {
-    kfree(addr);
+    if(vmalloc::contains_p(addr)) {
+      vmalloc::free(addr);
+    } else {
+      kfree(addr);
+    }
   }
 
   int Archive::load_into(tmpfs::DirectoryNode* top) {
@@ -6,7 +6,15 @@
 #include "list.hpp"
 #include "fs.hpp"
 
-#define KERNEL_STACK_SIZE 4096       // Use a 4kb (one page) kernel stack.
+// Bytes of kernel stack per thread, a whole number of pages. Override
+// with -DKERNEL_STACK_SIZE=... to give threads more room.
+#ifndef KERNEL_STACK_SIZE
+#define KERNEL_STACK_SIZE 4096
+#endif
+
+#if KERNEL_STACK_SIZE % 4096 != 0
+#error "KERNEL_STACK_SIZE must be a multiple of the page size"
+#endif
 
 namespace ipc {
   class Channel;
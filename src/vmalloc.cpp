@@ -0,0 +1,268 @@
+#include "vmalloc.hpp"
+#include "paging.hpp"
+#include "cpu.hpp"
+#include "spinlock.hpp"
+#include "scope.hpp"
+#include "reclaim.hpp"
+
+namespace vmalloc {
+  // Pages belonging to an area or its guard, including freed ones
+  // that may still be in the TLB.
+  static u32 used[cPages / 32];
+
+  // The last page of each area.
+  static u32 last[cPages / 32];
+
+  // Freed pages waiting on a flush before they can be used again.
+  static u32 stale[cPages / 32];
+  static u32 stale_count = 0;
+
+  static u32 mapped = 0;
+
+  static SpinLock lock;
+
+  static inline bool test(u32* map, u32 i) {
+    return (map[i / 32] & (1 << (i % 32))) != 0;
+  }
+
+  static inline void set(u32* map, u32 i) {
+    map[i / 32] |= (1 << (i % 32));
+  }
+
+  static inline void clear(u32* map, u32 i) {
+    map[i / 32] &= ~(1 << (i % 32));
+  }
+
+  static inline u32 page_address(u32 i) {
+    return VMALLOC_START + i * cpu::cPageSize;
+  }
+
+  static inline u32 page_index(void* ptr) {
+    return ((u32)ptr - VMALLOC_START) / cpu::cPageSize;
+  }
+
+  // First fit. Returns cPages if there is no run of count free pages.
+  static u32 find(u32 count) {
+    u32 run = 0;
+
+    for(u32 i = 0; i < cPages; i++) {
+      if(test(used, i)) {
+        run = 0;
+      } else if(++run == count) {
+        return i + 1 - count;
+      }
+    }
+
+    return cPages;
+  }
+
+  // Make the freed pages usable again. Nothing was invalidated when
+  // they were unmapped, so flush everything once now.
+  static void purge() {
+    cpu::flush_tlb_all();
+
+    for(u32 i = 0; i < cPages / 32; i++) {
+      used[i] &= ~stale[i];
+      stale[i] = 0;
+    }
+
+    stale_count = 0;
+  }
+
+  static void unback(u32 first, u32 count, bool owned) {
+    for(u32 i = first; i < first + count; i++) {
+      x86::Page* page = vmem.get_kernel_page(page_address(i), false);
+
+      if(owned) {
+        vmem.free_frame(page);
+      } else {
+        page->clear();
+      }
+    }
+  }
+
+  // Back count pages from first with frames. On failure, whatever was
+  // mapped is given back; nothing has touched it yet, so there's
+  // nothing in the TLB either.
+  static bool back(u32 first, u32 count) {
+    for(u32 i = first; i < first + count; i++) {
+      u32 frame;
+
+      if(!reclaim::alloc(0, &frame)) {
+        unback(first, i - first, true);
+        return false;
+      }
+
+      vmem.get_kernel_page(page_address(i), false)->assign(frame, true, true);
+    }
+
+    synchronized(lock) {
+      mapped += count;
+    }
+
+    return true;
+  }
+
+  void init() {
+    vmem.reserve_kernel_tables(VMALLOC_START, VMALLOC_END);
+  }
+
+  // Find room for count pages and a guard page in front of them.
+  // Returns cPages if there is none.
+  static u32 reserve(u32 count) {
+    synchronized(lock) {
+      u32 first = find(count + 1);
+
+      if(first == cPages && stale_count > 0) {
+        purge();
+        first = find(count + 1);
+      }
+
+      if(first == cPages) return cPages;
+
+      for(u32 i = first; i <= first + count; i++) set(used, i);
+      set(last, first + count);
+
+      return first;
+    }
+
+    return cPages;
+  }
+
+  // Undo reserve for pages that were never touched.
+  static void unreserve(u32 first, u32 count) {
+    synchronized(lock) {
+      for(u32 i = first; i <= first + count; i++) clear(used, i);
+      clear(last, first + count);
+    }
+  }
+
+  void* alloc(u32 size) {
+    if(size == 0) return 0;
+
+    u32 count = cpu::page_align(size) / cpu::cPageSize;
+
+    u32 first = reserve(count);
+    if(first == cPages) return 0;
+
+    if(!back(first + 1, count)) {
+      unreserve(first, count);
+      return 0;
+    }
+
+    return (void*)page_address(first + 1);
+  }
+
+  void* map(u32 frame, u32 count, bool writable) {
+    u32 first = reserve(count);
+    if(first == cPages) return 0;
+
+    for(u32 i = 0; i < count; i++) {
+      vmem.get_kernel_page(page_address(first + 1 + i), false)
+        ->assign(frame + i, writable, true);
+    }
+
+    return (void*)page_address(first + 1);
+  }
+
+  u32 size(void* ptr) {
+    u32 i = page_index(ptr);
+
+    synchronized(lock) {
+      u32 end = i;
+      while(!test(last, end)) end++;
+
+      return (end + 1 - i) * cpu::cPageSize;
+    }
+
+    return 0;
+  }
+
+  static void release(void* ptr, bool owned) {
+    ASSERT(contains_p(ptr) && ((u32)ptr & ~cpu::cPageMask) == 0);
+
+    u32 first = page_index(ptr);
+    ASSERT(first > 0 && test(used, first) && test(used, first - 1));
+
+    u32 count = size(ptr) / cpu::cPageSize;
+
+    unback(first, count, owned);
+
+    synchronized(lock) {
+      clear(last, first + count - 1);
+
+      for(u32 i = first - 1; i < first + count; i++) set(stale, i);
+
+      stale_count += count + 1;
+      if(owned) mapped -= count;
+
+      if(stale_count >= cLazyPages) purge();
+    }
+  }
+
+  void free(void* ptr) {
+    if(ptr) release(ptr, true);
+  }
+
+  void unmap(void* ptr) {
+    release(ptr, false);
+  }
+
+  void* realloc(void* ptr, u32 size) {
+    if(!ptr) return alloc(size);
+
+    u32 have = vmalloc::size(ptr);
+    if(size <= have) return ptr;
+
+    u32 end = page_index(ptr) + have / cpu::cPageSize;
+    u32 extra = (cpu::page_align(size) - have) / cpu::cPageSize;
+    bool fits = false;
+
+    synchronized(lock) {
+      if(end + extra <= cPages) {
+        fits = true;
+
+        for(u32 i = end; i < end + extra; i++) {
+          if(test(used, i)) {
+            fits = false;
+            break;
+          }
+        }
+      }
+
+      if(fits) {
+        for(u32 i = end; i < end + extra; i++) set(used, i);
+        clear(last, end - 1);
+        set(last, end + extra - 1);
+      }
+    }
+
+    if(fits) {
+      if(back(end, extra)) return ptr;
+
+      synchronized(lock) {
+        for(u32 i = end; i < end + extra; i++) clear(used, i);
+        clear(last, end + extra - 1);
+        set(last, end - 1);
+      }
+
+      return 0;
+    }
+
+    void* moved = alloc(size);
+    if(!moved) return 0;
+
+    memcpy((u8*)moved, (u8*)ptr, have);
+    free(ptr);
+
+    return moved;
+  }
+
+  u32 mapped_pages() {
+    return mapped;
+  }
+
+  u32 lazy_pages() {
+    return stale_count;
+  }
+}
@@ -0,0 +1,50 @@
+#ifndef VMALLOC_HPP
+#define VMALLOC_HPP
+
+#include "common.hpp"
+
+// Large kernel buffers are built from single frames stitched together
+// in their own region, so they never need a contiguous run of heap.
+// Each area has an unmapped guard page in front of it.
+#define VMALLOC_START 0xD3400000
+#define VMALLOC_END   0xD7400000
+
+namespace vmalloc {
+  const static u32 cPages = (VMALLOC_END - VMALLOC_START) / 0x1000;
+
+  // Freed areas aren't flushed from the TLB one by one. Their pages
+  // stay out of use until this many have piled up, then one flush
+  // clears them all.
+  const static u32 cLazyPages = 2048;
+
+  void init();
+
+  // Returns 0 if there is no room or no memory left.
+  void* alloc(u32 size);
+
+  // Grows in place when the pages after the area are free, otherwise
+  // moves. Shrinking keeps the area as it is.
+  void* realloc(void* ptr, u32 size);
+
+  void free(void* ptr);
+
+  // Map count frames from frame, which the caller owns, into the
+  // region. Returns 0 if there is no room.
+  void* map(u32 frame, u32 count, bool writable=true);
+
+  // Take away a mapping made by map, leaving the frames alone.
+  void unmap(void* ptr);
+
+  // Bytes usable at ptr.
+  u32 size(void* ptr);
+
+  static inline bool contains_p(void* ptr) {
+    return (u32)ptr >= VMALLOC_START && (u32)ptr < VMALLOC_END;
+  }
+
+  // Pages allocated here, and freed pages still waiting on a TLB flush.
+  u32 mapped_pages();
+  u32 lazy_pages();
+}
+
+#endif
@@ -0,0 +1,161 @@
+#include "working_set.hpp"
+#include "paging.hpp"
+#include "buddy.hpp"
+#include "process.hpp"
+#include "scheduler.hpp"
+#include "timer.hpp"
+#include "console.hpp"
+#include "cpu.hpp"
+
+namespace working_set {
+  static int hand_pid = 1;
+  static u32 hand_addr = 0;
+
+  static u32 bucket(u32 age) {
+    u32 b = 0;
+    while(b < cBuckets - 1 && (1U << b) <= age) b++;
+    return b;
+  }
+
+  static void age_page(x86::Page* p, u32 addr, bool current, Sample& s) {
+    if(p->swapped) {
+      s.swapped++;
+      return;
+    }
+
+    if(!p->present || !p->user || p->frame == vmem.zero_frame) return;
+
+    s.resident++;
+    if(p->dirty) s.dirty++;
+
+    u32 age = frames.age(p->frame);
+
+    if(p->accessed) {
+      p->accessed = 0;
+      if(current) cpu::invalidate_page(addr);
+      age = 0;
+    } else if(age < BuddyAllocator::cMaxAge) {
+      age++;
+    }
+
+    frames.set_age(p->frame, age);
+
+    if(age < cWindow) s.working_set++;
+    s.ages[bucket(age)]++;
+  }
+
+  // A 4M page has one accessed bit for all of it, so it's counted as
+  // one lump: used or not since the last pass.
+  static void age_large(x86::PageDirectory* dir, u32 idx, bool current,
+                        Sample& s)
+  {
+    const static u32 cAccessed = 0x20;
+    const static u32 cDirty = 0x40;
+    const static u32 cPages = x86::cLargePageSize / cpu::cPageSize;
+
+    u32& entry = dir->tablesPhysical[idx];
+
+    s.resident += cPages;
+    if(entry & cDirty) s.dirty += cPages;
+
+    if(entry & cAccessed) {
+      entry &= ~cAccessed;
+      if(current) cpu::invalidate_page(idx * x86::cLargePageSize);
+
+      s.working_set += cPages;
+      s.ages[0] += cPages;
+    } else {
+      s.ages[cBuckets - 1] += cPages;
+    }
+  }
+
+  static void next_process() {
+    if(++hand_pid >= constants::cMaxProcesses) hand_pid = 1;
+    hand_addr = 0;
+  }
+
+  // Look at up to budget entries. Interrupts are off while a table is
+  // being walked, so it can't be freed out from under us, but only for
+  // one table at a time.
+  static void scan(u32 budget) {
+    while(budget > 0) {
+      int st = cpu::disable_interrupts();
+
+      Process* proc = scheduler.find_process(hand_pid);
+
+      if(!proc || !proc->directory) {
+        next_process();
+        budget--;
+      } else if(hand_addr >= KERNEL_VIRTUAL_BASE) {
+        proc->publish_working_set(timer.ticks);
+        next_process();
+        budget--;
+      } else {
+        x86::PageDirectory* dir = proc->directory;
+        bool current = (dir == vmem.current_directory);
+        Sample& s = proc->working_set_pass();
+
+        u32 idx = hand_addr / x86::cLargePageSize;
+        u32 table_end = (idx + 1) * x86::cLargePageSize;
+        x86::PageTable* table = dir->tables[idx];
+
+        if(!table) {
+          if(x86::large_p(dir->tablesPhysical[idx])) {
+            age_large(dir, idx, current, s);
+          }
+
+          hand_addr = table_end;
+          budget--;
+        } else if(vmem.kernel_directory->tables[idx] == table) {
+          hand_addr = table_end;
+          budget--;
+        } else {
+          for(; hand_addr < table_end && budget > 0;
+              hand_addr += cpu::cPageSize, budget--) {
+            x86::Page* p = &table->pages[(hand_addr / cpu::cPageSize) % 1024];
+            age_page(p, hand_addr, current, s);
+          }
+        }
+      }
+
+      cpu::restore_interrupts(st);
+    }
+  }
+
+  static void scanner_loop() {
+    for(;;) {
+      scan(cBudget);
+      scheduler.sleep(cPeriod);
+    }
+  }
+
+  void start() {
+    scheduler.spawn_thread(scanner_loop);
+  }
+
+  bool sample(int pid, Sample* out) {
+    if(pid < 0 || pid >= constants::cMaxProcesses) return false;
+
+    Process* proc = pid ? scheduler.find_process(pid) : scheduler.process();
+    if(!proc) return false;
+
+    int st = cpu::disable_interrupts();
+    *out = proc->working_set();
+    cpu::restore_interrupts(st);
+
+    return true;
+  }
+
+  void print() {
+    for(int pid = 1; pid < constants::cMaxProcesses; pid++) {
+      Sample s;
+      if(!scheduler.find_process(pid) || !sample(pid, &s)) continue;
+      if(s.scans == 0) continue;
+
+      console.printf("%d: %d resident, %d working set, %d dirty, "
+                     "%d swapped; idle %d/%d/%d/%d/%d\n",
+                     pid, s.resident, s.working_set, s.dirty, s.swapped,
+                     s.ages[0], s.ages[1], s.ages[2], s.ages[3], s.ages[4]);
+    }
+  }
+}
@@ -0,0 +1,43 @@
+#ifndef WORKING_SET_HPP
+#define WORKING_SET_HPP
+
+#include "common.hpp"
+
+// A background thread walks the user page tables a little at a time,
+// clearing accessed bits and counting how many scans each frame has
+// gone untouched. Every time it gets through a whole process, the
+// process gets a fresh sample of what it's using.
+namespace working_set {
+  // Seconds between scans, and page table entries looked at per scan.
+  const static int cPeriod = 1;
+  const static u32 cBudget = 8192;
+
+  // A page is in the working set if it was used within this many
+  // scans of its process.
+  const static u32 cWindow = 2;
+
+  // Idle ages bucketed by powers of two: 0, 1, 2-3, 4-7, 8 and up.
+  const static u32 cBuckets = 5;
+
+  struct Sample {
+    u32 resident;
+    u32 working_set;
+    u32 dirty;
+    u32 swapped;
+    u32 ages[cBuckets];
+
+    // Complete passes so far, and timer.ticks at the end of the last.
+    u32 scans;
+    u32 ticks;
+  };
+
+  void start();
+
+  // The last complete sample for pid, 0 for the current process.
+  // Returns false if there is no such process.
+  bool sample(int pid, Sample* out);
+
+  void print();
+}
+
+#endif
@@ -0,0 +1,105 @@
+#include "zero_pool.hpp"
+#include "buddy.hpp"
+#include "paging.hpp"
+#include "spinlock.hpp"
+#include "scope.hpp"
+#include "rtc.hpp"
+#include "reclaim.hpp"
+
+namespace zero_pool {
+  static u32 pool[cSize];
+  static u32 count = 0;
+  static SpinLock lock;
+
+  static u32 pool_hits = 0;
+  static u32 pool_misses = 0;
+  static u64 cycles = 0;
+
+  static u32 shrink(u32 target) {
+    return drain(target);
+  }
+
+  static reclaim::Shrinker shrinker = {
+    "zero-pool", shrink, reclaim::eFrames, false, 0, 0
+  };
+
+  void init() {
+    reclaim::add(&shrinker);
+  }
+
+  bool take(u32* frame) {
+    synchronized(lock) {
+      if(count == 0) {
+        pool_misses++;
+        return false;
+      }
+
+      *frame = pool[--count];
+      pool_hits++;
+    }
+
+    return true;
+  }
+
+  void refill(u32 budget) {
+    u64 start = rdtsc();
+
+    for(u32 i = 0; i < budget; i++) {
+      if(count >= cSize || frames.free_frames() < cReserve) break;
+
+      u32 frame;
+      if(!frames.alloc(0, &frame)) break;
+
+      void* page = vmem.map_scratch(frame);
+      memset((u8*)page, 0, cpu::cPageSize);
+      vmem.unmap_scratch(page);
+
+      bool kept = false;
+
+      synchronized(lock) {
+        if(count < cSize) {
+          pool[count++] = frame;
+          kept = true;
+        }
+      }
+
+      if(!kept) frames.put(frame);
+    }
+
+    cycles += rdtsc() - start;
+  }
+
+  u32 drain(u32 max) {
+    u32 drained = 0;
+
+    while(drained < max) {
+      u32 frame;
+
+      synchronized(lock) {
+        if(count == 0) return drained;
+        frame = pool[--count];
+      }
+
+      frames.put(frame);
+      drained++;
+    }
+
+    return drained;
+  }
+
+  u32 available() {
+    return count;
+  }
+
+  u32 hits() {
+    return pool_hits;
+  }
+
+  u32 misses() {
+    return pool_misses;
+  }
+
+  u64 zeroing_cycles() {
+    return cycles;
+  }
+}
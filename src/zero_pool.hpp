@@ -0,0 +1,35 @@
+#ifndef ZERO_POOL_HPP
+#define ZERO_POOL_HPP
+
+#include "common.hpp"
+
+// Frames that have already been cleared, so that paths handing out
+// zeroed memory don't have to do it while someone waits. The idle
+// thread tops the pool up a few frames at a time.
+namespace zero_pool {
+  const static u32 cSize = 64;
+
+  // Frames cleared per refill call.
+  const static u32 cRefillBudget = 8;
+
+  // Leave at least this many frames free for everyone else.
+  const static u32 cReserve = 256;
+
+  // Hand the pool to the reclaimer.
+  void init();
+
+  // Take a zeroed frame. Returns false if the pool is empty.
+  bool take(u32* frame);
+
+  void refill(u32 budget);
+
+  // Give up to max frames back to the allocator, returns how many.
+  u32 drain(u32 max=cSize);
+
+  u32 available();
+  u32 hits();
+  u32 misses();
+  u64 zeroing_cycles();
+}
+
+#endif
@@ -0,0 +1,223 @@
+#include "zram.hpp"
+#include "swap.hpp"
+#include "slab.hpp"
+#include "buddy.hpp"
+#include "vmalloc.hpp"
+#include "kheap.hpp"
+#include "console.hpp"
+#include "reclaim.hpp"
+#include "spinlock.hpp"
+#include "scope.hpp"
+
+#include "zlib.h"
+
+namespace zram {
+  struct Entry {
+    void* data;
+    u32 size;    // Compressed bytes, 0 if the slot is empty.
+  };
+
+  static Entry* entries = 0;
+  static u32 nentries = 0;
+
+  // Class i holds objects of (i + 1) * cClassSize bytes.
+  static slab::Cache classes[cClasses];
+
+  // Raw deflate with a window the size of a page. There's no point
+  // in anything bigger, and the state stays small.
+  const static int cWindowBits = -12;
+  const static int cMemLevel = 5;
+
+  static z_stream deflater;
+  static z_stream inflater;
+
+  static u8 buffer[cMaxStored];
+
+  static Totals totals_;
+
+  // Guards the streams, the buffer and the entries.
+  static SpinLock lock;
+
+  static inline u32 class_for(u32 size) {
+    return (size - 1) / cClassSize;
+  }
+
+  static void* zalloc(void* cookie, uInt items, uInt size) {
+    if(items * size >= 4 * cpu::cPageSize) return vmalloc::alloc(items * size);
+    return (void*)kmalloc(items * size);
+  }
+
+  static void zfree(void* cookie, void* addr) {
+    if(vmalloc::contains_p(addr)) {
+      vmalloc::free(addr);
+    } else {
+      kfree(addr);
+    }
+  }
+
+  class Backend : public swap::Backend {
+  public:
+    const char* name() {
+      return "zram";
+    }
+
+    u32 size() {
+      return nentries;
+    }
+
+    bool write(u32 slot, u8* page);
+    bool read(u32 slot, u8* page);
+    void discard(u32 slot);
+  };
+
+  bool Backend::write(u32 slot, u8* page) {
+    synchronized(lock) {
+      deflateReset(&deflater);
+
+      deflater.next_in = page;
+      deflater.avail_in = cpu::cPageSize;
+      deflater.next_out = buffer;
+      deflater.avail_out = cMaxStored;
+
+      // Didn't fit in cMaxStored.
+      if(deflate(&deflater, Z_FINISH) != Z_STREAM_END) {
+        totals_.rejected++;
+        return false;
+      }
+
+      u32 size = cMaxStored - deflater.avail_out;
+      slab::Cache& cache = classes[class_for(size)];
+
+      // With no frames left the pool can only use the room it has.
+      if(frames.free_frames() == 0 && !cache.room_p()) return false;
+
+      void* data = cache.alloc();
+      if(!data) return false;
+
+      memcpy((u8*)data, buffer, size);
+
+      entries[slot].data = data;
+      entries[slot].size = size;
+
+      totals_.pages++;
+      totals_.original_bytes += cpu::cPageSize;
+      totals_.compressed_bytes += size;
+      totals_.pool_bytes += cache.object_size();
+
+      return true;
+    }
+
+    return false;
+  }
+
+  bool Backend::read(u32 slot, u8* page) {
+    synchronized(lock) {
+      Entry& entry = entries[slot];
+      if(entry.size == 0) return false;
+
+      inflateReset(&inflater);
+
+      inflater.next_in = (u8*)entry.data;
+      inflater.avail_in = entry.size;
+      inflater.next_out = page;
+      inflater.avail_out = cpu::cPageSize;
+
+      return inflate(&inflater, Z_FINISH) == Z_STREAM_END &&
+             inflater.avail_out == 0;
+    }
+
+    return false;
+  }
+
+  void Backend::discard(u32 slot) {
+    synchronized(lock) {
+      Entry& entry = entries[slot];
+      if(entry.size == 0) return;
+
+      totals_.pages--;
+      totals_.original_bytes -= cpu::cPageSize;
+      totals_.compressed_bytes -= entry.size;
+      totals_.pool_bytes -= classes[class_for(entry.size)].object_size();
+
+      slab::free(entry.data);
+
+      entry.data = 0;
+      entry.size = 0;
+    }
+  }
+
+  // Discarded pages leave empty pages in the classes behind.
+  static u32 shrink(u32 target) {
+    u32 released = 0;
+
+    for(u32 i = 0; i < cClasses && released < target; i++) {
+      released += classes[i].shrink();
+    }
+
+    return released;
+  }
+
+  static reclaim::Shrinker shrinker = {
+    "zram", shrink, reclaim::eObjects, false, 0, 0
+  };
+
+  void init(u32 pages) {
+    if(pages > swap::cMaxSlots) pages = swap::cMaxSlots;
+
+    entries = (Entry*)vmalloc::alloc(pages * sizeof(Entry));
+    if(!entries) return;
+
+    memset((u8*)entries, 0, pages * sizeof(Entry));
+
+    for(u32 i = 0; i < cClasses; i++) {
+      classes[i].init("zram", (i + 1) * cClassSize);
+    }
+
+    deflater.zalloc = zalloc;
+    deflater.zfree = zfree;
+    deflater.opaque = Z_NULL;
+
+    inflater.zalloc = zalloc;
+    inflater.zfree = zfree;
+    inflater.opaque = Z_NULL;
+    inflater.next_in = Z_NULL;
+    inflater.avail_in = 0;
+
+    if(deflateInit2(&deflater, Z_BEST_SPEED, Z_DEFLATED, cWindowBits,
+                    cMemLevel, Z_DEFAULT_STRATEGY) != Z_OK ||
+       inflateInit2(&inflater, cWindowBits) != Z_OK)
+    {
+      console.printf("zram: unable to set up zlib\n");
+      vmalloc::free(entries);
+      entries = 0;
+      return;
+    }
+
+    nentries = pages;
+
+    reclaim::add(&shrinker);
+    swap::add(new(kheap) Backend(), cPriority);
+  }
+
+  u32 stored_size(u32 slot) {
+    if(slot >= nentries) return 0;
+    return entries[slot].size;
+  }
+
+  Totals& totals() {
+    return totals_;
+  }
+
+  void print() {
+    console.printf("zram: %d pages, %dkB compressed into %dkB, "
+                   "%d rejected\n",
+                   totals_.pages, totals_.original_bytes / 1024,
+                   totals_.pool_bytes / 1024, totals_.rejected);
+
+    if(totals_.original_bytes > 0) {
+      console.printf("zram: pool is %d%% of the original size\n",
+                     (totals_.pool_bytes / 1024) * 100 /
+                     (totals_.original_bytes / 1024));
+    }
+  }
+}
@@ -0,0 +1,39 @@
+#ifndef ZRAM_HPP
+#define ZRAM_HPP
+
+#include "common.hpp"
+
+// Swap that never leaves memory. Pages are deflated and kept in a
+// pool of size classes, so a page that compresses to a quarter only
+// costs a quarter of a frame. It is preferred over a swap partition.
+namespace zram {
+  const static int cPriority = 100;
+
+  // Compressed pages are rounded up to a multiple of this.
+  const static u32 cClassSize = 64;
+
+  // Pages that don't compress to this or less aren't worth keeping,
+  // they're left for the next swap area or stay where they are.
+  const static u32 cMaxStored = 3072;
+
+  const static u32 cClasses = cMaxStored / cClassSize;
+
+  struct Totals {
+    u32 pages;           // Pages stored.
+    u32 original_bytes;  // What they'd take uncompressed.
+    u32 compressed_bytes;
+    u32 pool_bytes;      // Including rounding up to the class size.
+    u32 rejected;        // Pages that didn't compress well enough.
+  };
+
+  // Add a zram area with room for up to pages pages.
+  void init(u32 pages);
+
+  // Compressed size of the page in slot, 0 if nothing is stored.
+  u32 stored_size(u32 slot);
+
+  Totals& totals();
+  void print();
+}
+
+#endif